@@ -3,8 +3,76 @@
 // thus we simulate the #include "CLRadixSortParam.hpp" by
 // string manipulations
 
+// type of the keys in the lists (see _KEYBITS)
+#if _KEYBITS == 8
+typedef uchar keytype;
+#elif _KEYBITS == 16
+typedef ushort keytype;
+#else
+typedef int keytype;
+#endif
+
+// subgroup variants of the kernels, if the device has the extensions
+// (the work items of a subgroup have consecutive local ids)
+#ifdef SUBGROUPS
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#define _SGSCAN
+#ifdef cl_khr_subgroup_ballot
+#pragma OPENCL EXTENSION cl_khr_subgroup_ballot : enable
+#define _SGRANK
+#endif
+#endif
+#ifdef cl_intel_subgroups
+#pragma OPENCL EXTENSION cl_intel_subgroups : enable
+#define _SGSCAN
+#endif
+#endif
+
+#ifdef LOCALATOMIC
+// compute the histogram for each radix and each group for the pass
+// the items of a group share one local histogram (local atomics)
+// the group gr treats the keys gr*size*items .. (gr+1)*size*items-1
+// by rows of items keys
+__kernel void histogram(const __global keytype* d_Keys,
+			__global int* d_Histograms,
+			const int pass,
+			__local int* loc_histo,
+			const int n){
+
+  int it = get_local_id(0);
+  int gr = get_group_id(0);
+
+  int groups=get_num_groups(0);
+  int items=get_local_size(0);
+
+  // set the local histogram to zero
+  for(int ir=it;ir<_RADIX;ir+=items){
+    loc_histo[ir] = 0;
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  int size= n/groups/items; // number of rows of the group
+  int start= gr * size * items; // beginning of the sub-list
+
+  for(int j= 0; j< size;j++){
+    int key=d_Keys[start + j * items + it];
+    int shortkey=(( key >> (pass * _BITS)) & (_RADIX-1));
+    atomic_inc(loc_histo + shortkey);
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // copy the local histogram to the global one
+  for(int ir=it;ir<_RADIX;ir+=items){
+    d_Histograms[ir * groups + gr]=loc_histo[ir];
+  }
+
+}
+#else
 // compute the histogram for each radix and each virtual processor for the pass
-__kernel void histogram(const __global int* d_Keys,
+__kernel void histogram(const __global keytype* d_Keys,
 			__global int* d_Histograms,
 			const int pass,
 			__local int* loc_histo,
@@ -34,21 +102,34 @@ __kernel void histogram(const __global int* d_Keys,
 
   // compute the index
   // the computation depends on the transposition
-  for(int j= 0; j< size;j++){
+  // (with VECTORIZE, k is the index of a block of four keys)
+  for(int j= 0; j< size/_VECSIZE;j++){
 #ifdef TRANSPOSE
-    k= groups * items * j + ig;
+    // the first pass reads the list in its natural order
+    k= (pass == 0) ? j+start/_VECSIZE : groups * items * j + ig;
+#else
+    k=j+start/_VECSIZE;
+#endif
+
+#ifdef VECTORIZE
+    int4 key4=vload4(k,d_Keys);
+    int keyv[4]={key4.x,key4.y,key4.z,key4.w};
+#endif
+
+    for(int c=0;c<_VECSIZE;c++){
+#ifdef VECTORIZE
+      key=keyv[c];
 #else
-    k=j+start;
+      key=d_Keys[k];
 #endif
-      
-    key=d_Keys[k];   
 
-    // extract the group of _BITS bits of the pass
-    // the result is in the range 0.._RADIX-1
-    shortkey=(( key >> (pass * _BITS)) & (_RADIX-1));  
+      // extract the group of _BITS bits of the pass
+      // the result is in the range 0.._RADIX-1
+      shortkey=(( key >> (pass * _BITS)) & (_RADIX-1));  
 
-    // increment the local histogram
-    loc_histo[shortkey *  items + it ]++;
+      // increment the local histogram
+      loc_histo[shortkey *  items + it ]++;
+    }
   }
 
   barrier(CLK_LOCAL_MEM_FENCE);  
@@ -62,58 +143,252 @@ __kernel void histogram(const __global int* d_Keys,
 
 
 }
+#endif
 
-// initial transpose of the list for improving
-// coalescent memory access
-__kernel void transpose(const __global int* invect,
-			__global int* outvect,
-			const int nbcol,
-			const int nbrow,
-			const __global int* inperm,
-			__global int* outperm,
-			__local int* blockmat,
-			__local int* blockperm,
-			const int tilesize){
-  
-  int i0 = get_global_id(0)*tilesize;  // first row index
-  int j = get_global_id(1);  // column index
+// bits of the 16 low bits of v at the even positions
+inline uint spreadbits(uint v){
+  v &= 0xFFFF;
+  v = (v | (v << 8)) & 0x00FF00FF;
+  v = (v | (v << 4)) & 0x0F0F0F0F;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
 
-  int jloc = get_local_id(1);  // local column index
+// keys of the cells of particles on a grid of nx*ny cells of origin
+// (x0,y0) (invdx and invdy are the inverses of the sizes of the cells)
+// key = ix*ny+iy, or the Morton code of (ix,iy) (bits of ix and iy
+// interleaved) if morton != 0; the particles outside the grid are put
+// in the cells of the boundary
+// the histogram of the first pass of the sort is computed at the same
+// time (the keys are read in the order of the first pass of histogram)
+__kernel void cellkeys(const __global float* d_X,
+		       const __global float* d_Y,
+		       __global keytype* d_Keys,
+		       __global int* d_Permut,
+		       __global int* d_Histograms,
+		       __local int* loc_histo,
+		       const float x0,
+		       const float y0,
+		       const float invdx,
+		       const float invdy,
+		       const int nx,
+		       const int ny,
+		       const int morton,
+		       const int np,
+		       const int n){
 
-  // fill the cache
-  for(int iloc=0;iloc<tilesize;iloc++){
-    int k=(i0+iloc)*nbcol+j;  // position in the matrix
-    blockmat[iloc*tilesize+jloc]=invect[k];
-#ifdef PERMUT 
-    blockperm[iloc*tilesize+jloc]=inperm[k];
-#endif
+  int it = get_local_id(0);
+  int ig = get_global_id(0);
+  int gr = get_group_id(0);
+
+  int groups=get_num_groups(0);
+  int items=get_local_size(0);
+
+#ifdef LOCALATOMIC
+  for(int ir=it;ir<_RADIX;ir+=items){
+    loc_histo[ir] = 0;
+  }
+#else
+  for(int ir=0;ir<_RADIX;ir++){
+    loc_histo[ir * items + it] = 0;
   }
+#endif
 
-  barrier(CLK_LOCAL_MEM_FENCE);  
+  barrier(CLK_LOCAL_MEM_FENCE);
 
-  // first row index in the transpose
-  int j0=get_group_id(1)*tilesize;
+  int size= n/groups/items;
 
-  // put the cache at the good place
-  for(int iloc=0;iloc<tilesize;iloc++){
-    int kt=(j0+iloc)*nbrow+i0+jloc;  // position in the transpose
-    outvect[kt]=blockmat[jloc*tilesize+iloc];
-#ifdef PERMUT 
-      outperm[kt]=blockperm[jloc*tilesize+iloc];
+  for(int j= 0; j< size;j++){
+#ifdef LOCALATOMIC
+    int k= gr * size * items + j * items + it;
+#else
+    int k= ig * size + j;
+#endif
+
+    uint key;
+    if (k < np) {
+      int ix=clamp((int) floor((d_X[k]-x0)*invdx),0,nx-1);
+      int iy=clamp((int) floor((d_Y[k]-y0)*invdy),0,ny-1);
+      key= morton ? (spreadbits(ix) << 1) | spreadbits(iy) : ix*ny+iy;
+      d_Keys[k]=key;
+    }
+    else {
+      // the padding keys are already set
+      key=d_Keys[k];
+    }
+#ifdef PERMUT
+    d_Permut[k]=k;
+#endif
+
+    int shortkey=(key & (_RADIX-1));
+#ifdef LOCALATOMIC
+    atomic_inc(loc_histo + shortkey);
+#else
+    loc_histo[shortkey * items + it]++;
 #endif
   }
- 
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+#ifdef LOCALATOMIC
+  for(int ir=it;ir<_RADIX;ir+=items){
+    d_Histograms[ir * groups + gr]=loc_histo[ir];
+  }
+#else
+  for(int ir=0;ir<_RADIX;ir++){
+    d_Histograms[items * (ir * groups + gr) + it]=loc_histo[ir * items + it];
+  }
+#endif
+
 }
 
+#ifdef LOCALATOMIC
+// each group reorders its rows of keys using the scanned histogram
+// the rank of a key in its row is computed from a mask of the items
+// of the row for each digit (stored after the histogram in the local
+// memory): the keys of the lower items with the same digit are counted
+// so that the sort remains stable
+__kernel void reorder(const __global keytype* d_inKeys,
+		      __global keytype* d_outKeys,
+		      __global int* d_Histograms,
+		      const int pass,
+		      __global int* d_inPermut,
+		      __global int* d_outPermut,
+		      __local int* loc_histo,
+		      const int n,
+		      const int npass){
+
+  int it = get_local_id(0);
+  int gr = get_group_id(0);
+
+  int groups=get_num_groups(0);
+  int items=get_local_size(0);
+
+  int size= n/groups/items;
+  int start= gr * size * items;
+
+  __local int* loc_mask=loc_histo+_RADIX;
+
+  // take the histogram in the cache
+  for(int ir=it;ir<_RADIX;ir+=items){
+    loc_histo[ir]=d_Histograms[ir * groups + gr];
+  }
+  for(int i=it;i<_RADIX*_RANKWORDS;i+=items){
+    loc_mask[i]=0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // word and bit of the item in the masks
+  int w=it/32;
+  uint lowbits=(1u << (it%32))-1;
+
+#ifdef _SGRANK
+  // counts of the digits in each subgroup, for two consecutive rows
+  // (if the subgroups are too small, the usual ranking is used)
+  __local int* loc_sgcount=loc_mask+_RADIX*_RANKWORDS;
+  int sg=get_sub_group_id();
+  int nsg=get_num_sub_groups();
+  int sgrank= (nsg <= _ITEMS / _SUBGROUPMIN);
+  for(int i=it;i<2*_RADIX*nsg && sgrank;i+=items){
+    loc_sgcount[i]=0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  uint4 active=sub_group_ballot(1);
+  uint4 lower=get_sub_group_lt_mask();
+#endif
+
+  for(int j= 0; j< size;j++){
+    int k= start + j * items + it;
+    int key = d_inKeys[k];
+    int shortkey=((key >> (pass * _BITS)) & (_RADIX-1));
+
+    int newpos;
+
+#ifdef _SGRANK
+    if (sgrank) {
+      // keys of the subgroup with the same digit: one ballot per bit
+      uint4 same=active;
+      for(int b=0;b<_BITS;b++){
+	uint4 bit=sub_group_ballot((shortkey >> b) & 1);
+	same &= ((shortkey >> b) & 1) ? bit : ~bit;
+      }
+      int rank=sub_group_ballot_bit_count(same & lower);
+      int count=sub_group_ballot_bit_count(same);
+
+      __local int* sgcount=loc_sgcount+(j%2)*_RADIX*nsg;
+      if (rank == count-1) sgcount[sg*_RADIX+shortkey]=count;
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      // keys of the previous subgroups with the same digit
+      int before=0,total=0;
+      for(int s=0;s<nsg;s++){
+	int c=sgcount[s*_RADIX+shortkey];
+	if (s < sg) before+=c;
+	total+=c;
+      }
+      newpos=loc_histo[shortkey]+before+rank;
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      // the last key of each digit updates the histogram
+      // (the other row of counts is used by the next row of keys)
+      if (rank == count-1) {
+	if (before+count == total) loc_histo[shortkey] += total;
+	sgcount[sg*_RADIX+shortkey]=0;
+      }
+    }
+    else
+#endif
+    {
+    __local int* mask=loc_mask+shortkey*_RANKWORDS;
+    atomic_or(mask+w,1u << (it%32));
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // rank of the key among the keys of the row with the same digit
+    int rank=popcount((uint) mask[w] & lowbits),count=0;
+    for(int i=0;i<_RANKWORDS;i++){
+      int c=popcount((uint) mask[i]);
+      if (i < w) rank+=c;
+      count+=c;
+    }
+
+    newpos=loc_histo[shortkey]+rank;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // the last key of each digit updates the histogram
+    // and clears the mask for the next row
+    if (rank == count-1) {
+      loc_histo[shortkey] += count;
+      for(int i=0;i<_RANKWORDS;i++) mask[i]=0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+#ifdef SINGLESCRATCH
+    if (d_outKeys != 0) d_outKeys[newpos]= key;
+    if (d_outPermut != 0) d_outPermut[newpos]=d_inPermut[k];
+#else
+    d_outKeys[newpos]= key;
+#ifdef PERMUT
+    d_outPermut[newpos]=d_inPermut[k];
+#endif
+#endif
+  }
+
+}
+#else
 // each virtual processor reorders its data using the scanned histogram
-__kernel void reorder(const __global int* d_inKeys,
-		      __global int* d_outKeys,
+__kernel void reorder(const __global keytype* d_inKeys,
+		      __global keytype* d_outKeys,
 		      __global int* d_Histograms,
 		      const int pass,
 		      __global int* d_inPermut,
 		      __global int* d_outPermut,
 		      __local int* loc_histo,
-		      const int n){
+		      const int n,
+		      const int npass){
 
   int it = get_local_id(0);
   int ig = get_global_id(0);
@@ -135,41 +410,112 @@ __kernel void reorder(const __global int* d_inKeys,
 
   int newpos,key,shortkey,k,newpost;
 
-  for(int j= 0; j< size;j++){
+  // (with VECTORIZE, k is the index of a block of four keys)
+  for(int j= 0; j< size/_VECSIZE;j++){
 #ifdef TRANSPOSE
-      k= groups * items * j + ig;
+      // the first pass reads the list in its natural order
+      k= (pass == 0) ? j+start/_VECSIZE : groups * items * j + ig;
 #else
-      k=j+start;
+      k=j+start/_VECSIZE;
 #endif
-    key = d_inKeys[k];   
-    shortkey=((key >> (pass * _BITS)) & (_RADIX-1)); 
 
-    newpos=loc_histo[shortkey * items + it];
+#ifdef VECTORIZE
+    int4 key4=vload4(k,d_inKeys);
+    int keyv[4]={key4.x,key4.y,key4.z,key4.w};
+#endif
+
+    for(int c=0;c<_VECSIZE;c++){
+#ifdef VECTORIZE
+      key = keyv[c];
+#else
+      key = d_inKeys[k];   
+#endif
+      int kc = k * _VECSIZE + c; // position of the key in the list
+      shortkey=((key >> (pass * _BITS)) & (_RADIX-1)); 
+
+      newpos=loc_histo[shortkey * items + it];
 
 
 #ifdef TRANSPOSE
-    int ignew,jnew;
-    ignew= newpos/(n/groups/items);
-    jnew = newpos%(n/groups/items);
-    newpost = jnew * (groups*items) + ignew;
+      // the transposition keeps the blocks of _VECSIZE keys together
+      // the last pass writes the list in its natural order
+      int ignew,jnew;
+      ignew= newpos/(n/groups/items);
+      jnew = newpos%(n/groups/items);
+      newpost = (pass == npass-1) ? newpos :
+	(jnew/_VECSIZE * (groups*items) + ignew) * _VECSIZE + jnew%_VECSIZE;
 #else
-    newpost=newpos;
+      newpost=newpos;
 #endif
 
-    d_outKeys[newpost]= key;  // killing line !!!
+#ifdef SINGLESCRATCH
+      // the keys and the permutation are reordered by two calls
+      if (d_outKeys != 0) d_outKeys[newpost]= key;
+      if (d_outPermut != 0) d_outPermut[newpost]=d_inPermut[kc];
+#else
+      d_outKeys[newpost]= key;  // killing line !!!
 
 #ifdef PERMUT 
-      d_outPermut[newpost]=d_inPermut[k]; 
+        d_outPermut[newpost]=d_inPermut[kc]; 
+#endif
 #endif
 
-    newpos++;
-    loc_histo[shortkey * items + it]=newpos;
+      newpos++;
+      loc_histo[shortkey * items + it]=newpos;
+    }
 
   }  
 
 }
+#endif
+
 
+#ifdef _SGSCAN
+// scan of the local histograms with the subgroup functions:
+// scan of the pairs of values in each subgroup, then scan of the
+// sums of the subgroups by the first subgroup (two barriers instead
+// of two per level of the tree)
+__kernel void scanhistograms( __global int* histo,__local int* temp,__global int* globsum){
+
+  int it = get_local_id(0);
+  int ig = get_global_id(0);
+  int gr=get_group_id(0);
+
+  int sg=get_sub_group_id();
+  int nsg=get_num_sub_groups();
+  int lane=get_sub_group_local_id();
+  int sgsize=get_sub_group_size();
+
+  int a=histo[2*ig];
+  int b=histo[2*ig+1];
+
+  int s=sub_group_scan_exclusive_add(a+b);
+
+  // sum of the subgroup
+  if (lane == sgsize-1) temp[sg]=s+a+b;
+  barrier(CLK_LOCAL_MEM_FENCE);
 
+  // exclusive scan of the sums of the subgroups
+  if (sg == 0) {
+    int carry=0;
+    for(int base=0;base<nsg;base+=sgsize){
+      int v= (base+lane < nsg) ? temp[base+lane] : 0;
+      int e=sub_group_scan_exclusive_add(v);
+      if (base+lane < nsg) temp[base+lane]=carry+e;
+      carry+=sub_group_reduce_add(v);
+    }
+    // store the sum of the group for the next step
+    if (lane == 0) globsum[gr]=carry;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  s+=temp[sg];
+
+  histo[2*ig] = s;
+  histo[2*ig+1] = s+a;
+
+}
+#else
 // perform a parallel prefix sum (a scan) on the local histograms
 // (see Blelloch 1990) each workitem worries about two memories
 // see also http://http.developer.nvidia.com/GPUGems3/gpugems3_ch39.html
@@ -231,6 +577,7 @@ __kernel void scanhistograms( __global int* histo,__local int* temp,__global int
   barrier(CLK_GLOBAL_MEM_FENCE);
 
 }  
+#endif
 
 // use the global sum for updating the local histograms
 // each work item updates two values
@@ -252,5 +599,499 @@ __kernel void pastehistograms( __global int* histo,__global int* globsum){
 
 }  
 
+// compaction of the keys whose digit of the pass is equal to radix
+// (radix selection: the candidates of the next digit)
+// the order of the keys is not preserved
+__kernel void selectradix(const __global keytype* d_inKeys,
+			  __global keytype* d_outKeys,
+			  const int pass,
+			  const int radix,
+			  const int n,
+			  __global int* d_count){
 
+  int ig = get_global_id(0);
+  int nbitems = get_global_size(0);
 
+  for(int k=ig;k<n;k+=nbitems){
+    int key=d_inKeys[k];
+    if (((key >> (pass * _BITS)) & (_RADIX-1)) == radix){
+      d_outKeys[atomic_inc(d_count)]=key;
+    }
+  }
+
+}
+
+// copy the keys smaller than kth and the nequal first keys equal to kth
+// at the beginning of the output list (the k smallest keys, unordered)
+__kernel void topk(const __global keytype* d_inKeys,
+		   __global keytype* d_outKeys,
+		   const __global int* d_inPermut,
+		   __global int* d_outPermut,
+		   const int kth,
+		   const int nless,
+		   const int nequal,
+		   const int n,
+		   __global int* d_count){
+
+  int ig = get_global_id(0);
+  int nbitems = get_global_size(0);
+
+  for(int k=ig;k<n;k+=nbitems){
+    uint key=d_inKeys[k];
+    int pos=-1;
+    if (key < (uint) kth){
+      pos=atomic_inc(d_count);
+    }
+    else if (key == (uint) kth){
+      pos=atomic_inc(d_count+1);
+      pos= pos < nequal ? nless+pos : -1;
+    }
+    if (pos >= 0){
+      d_outKeys[pos]=key;
+#ifdef PERMUT
+      d_outPermut[pos]=d_inPermut[k];
+#endif
+    }
+  }
+
+}
+
+// table of the first index of each cell in the sorted list
+// (reduce by key): d_Offsets[c] is the number of keys < c
+// work item i fills the cells between the keys i-1 and i
+// (the keys >= ncells are clamped: they are after d_Offsets[ncells])
+__kernel void celloffsets(const __global keytype* d_Keys,
+			  __global int* d_Offsets,
+			  const int n,
+			  const uint ncells){
+
+  int i = get_global_id(0);
+
+  if (i > n) return;
+
+  uint first= (i == 0) ? 0 : min((uint) d_Keys[i-1],ncells)+1;
+  uint last= (i == n) ? ncells : min((uint) d_Keys[i],ncells);
+
+  for(uint c=first;c<=last;c++){
+    d_Offsets[c]=i;
+  }
+
+}
+
+// merge of two sorted lists A (na keys) and B (nb keys) along the
+// merge path: the work item ig writes the outputs ig*chunk..(ig+1)*chunk-1
+// its starting point is found by a binary search on the diagonal
+// for equal keys, the keys of A come first
+__kernel void mergepath(const __global keytype* d_KeysA,
+			const __global int* d_PermutA,
+			const int na,
+			const __global keytype* d_KeysB,
+			const __global int* d_PermutB,
+			const int nb,
+			__global keytype* d_outKeys,
+			__global int* d_outPermut,
+			const int permoffset,
+			const int chunk){
+
+  int ig = get_global_id(0);
+
+  int diag=ig*chunk;
+  int n=na+nb;
+
+  if (diag >= n) return;
+
+  // number of keys of A in the diag first outputs
+  int lo= max(0,diag-nb);
+  int hi= min(diag,na);
+  while(lo < hi){
+    int mid=(lo+hi)/2;
+    if ((uint) d_KeysA[mid] <= (uint) d_KeysB[diag-1-mid]) lo=mid+1;
+    else hi=mid;
+  }
+
+  int i=lo;
+  int j=diag-lo;
+  int end=min(diag+chunk,n);
+
+  // sequential merge of the chunk
+  for(int k=diag;k<end;k++){
+    if (j >= nb || (i < na && (uint) d_KeysA[i] <= (uint) d_KeysB[j])){
+#ifdef SINGLESCRATCH
+      if (d_outKeys != 0) d_outKeys[k]=d_KeysA[i];
+      if (d_outPermut != 0) d_outPermut[k]=d_PermutA[i];
+#else
+      d_outKeys[k]=d_KeysA[i];
+#ifdef PERMUT
+      d_outPermut[k]=d_PermutA[i];
+#endif
+#endif
+      i++;
+    }
+    else {
+#ifdef SINGLESCRATCH
+      if (d_outKeys != 0) d_outKeys[k]=d_KeysB[j];
+      if (d_outPermut != 0) d_outPermut[k]=d_PermutB[j]+permoffset;
+#else
+      d_outKeys[k]=d_KeysB[j];
+#ifdef PERMUT
+      d_outPermut[k]=d_PermutB[j]+permoffset;
+#endif
+#endif
+      j++;
+    }
+  }
+
+}
+
+// keys of a list of records (array of structures): the key of the
+// record i is the unsigned integer of keywidth bytes (little endian)
+// at the byte keyoffset of the record
+// with descending, the keys are complemented so that the sort is
+// in decreasing order; the permutation is initialized to the identity
+__kernel void recordkeys(const __global uchar* d_Records,
+			 __global keytype* d_Keys,
+			 __global int* d_Permut,
+			 const int stride,
+			 const int keyoffset,
+			 const int keywidth,
+			 const int descending,
+			 const uint top,
+			 const int nrec,
+			 const int n,
+			 __global uint* d_max){
+
+  int i = get_global_id(0);
+
+  // largest key of the group, then of the list
+  __local uint loc_max;
+  if (get_local_id(0) == 0) loc_max=0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  d_Permut[i]=i;
+
+  // the padding keys are already set
+  if (i < nrec) {
+    const __global uchar* p=d_Records+(size_t) i*stride+keyoffset;
+
+    uint key=0;
+    for(int b=keywidth-1;b>=0;b--){
+      key=(key << 8) | p[b];
+    }
+    atomic_max(&loc_max,key);
+
+    // the keys larger than top are rejected by the host
+    if (descending) key=top-key;
+
+    d_Keys[i]=key;
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (get_local_id(0) == 0) atomic_max(d_max,loc_max);
+
+}
+
+// copy of the records in the order of the permutation:
+// the work item i copies the record d_Permut[i] at the position i
+__kernel void reorderrecords(const __global uchar* d_inRecords,
+			     __global uchar* d_outRecords,
+			     const __global int* d_Permut,
+			     const int stride,
+			     const int nrec){
+
+  int i = get_global_id(0);
+
+  if (i >= nrec) return;
+
+  int src=d_Permut[i];
+
+  // padding keys are never before the keys of the list
+  if (src >= nrec) return;
+
+  const __global uchar* from=d_inRecords+(size_t) src*stride;
+  __global uchar* to=d_outRecords+(size_t) i*stride;
+
+  if (stride % 4 == 0) {
+    for(int b=0;b<stride/4;b++){
+      ((__global uint*) to)[b]=((const __global uint*) from)[b];
+    }
+  }
+  else {
+    for(int b=0;b<stride;b++){
+      to[b]=from[b];
+    }
+  }
+
+}
+
+// packing of a key column for the lexicographic sort: the bits
+// shift..shift+bits-1 of the column, taken in the order of the
+// permutation, are appended to the low bits of the keys
+// (start: first column of the key, init: first key of the sort,
+// with the identity permutation)
+__kernel void packkeys(const __global uint* d_Col,
+		       __global keytype* d_Keys,
+		       __global int* d_Permut,
+		       const int shift,
+		       const int bits,
+		       const int start,
+		       const int init,
+		       const int nrec,
+		       const int n){
+
+  int i = get_global_id(0);
+
+  if (i >= n) return;
+
+  if (init) d_Permut[i]=i;
+
+  // the padding keys are already set
+  if (i >= nrec) return;
+
+  int src= init ? i : d_Permut[i];
+
+  uint digit=(d_Col[src] >> shift) & (0xFFFFFFFFu >> (32-bits));
+  uint key= start ? 0 : d_Keys[i];
+
+  d_Keys[i]=(key << bits) | digit;
+
+}
+
+// largest key of the list
+__kernel void maxkey(const __global keytype* d_Keys,
+		     const int n,
+		     __global uint* d_max){
+
+  int ig = get_global_id(0);
+  int nbitems = get_global_size(0);
+
+  uint m=0;
+  for(int k=ig;k<n;k+=nbitems){
+    m=max(m,(uint) d_Keys[k]);
+  }
+
+  atomic_max(d_max,m);
+
+}
+
+// sort of a small list (n <= _SMALLSORT) by one work group in local
+// memory: bitonic sort of the pairs (key,index), which is stable
+// because the pairs are distinct
+__kernel void smallsort(__global keytype* d_Keys,
+			__global int* d_Permut,
+			const int n,
+			__local uint* loc_keys,
+			__local int* loc_index){
+
+  int it = get_local_id(0);
+  int items=get_local_size(0);
+
+  // the list is padded to a power of two with the largest key
+  int size=1;
+  while(size < n) size*=2;
+
+  for(int i=it;i<size;i+=items){
+    loc_keys[i]= (i < n) ? (uint) d_Keys[i] : _KEYMASK;
+    loc_index[i]=i;
+  }
+
+  for(int k=2;k<=size;k*=2){
+    for(int j=k/2;j>0;j/=2){
+      barrier(CLK_LOCAL_MEM_FENCE);
+      for(int i=it;i<size;i+=items){
+	int l=i^j;
+	if (l > i){
+	  uint ki=loc_keys[i],kl=loc_keys[l];
+	  int ii=loc_index[i],il=loc_index[l];
+	  int greater= ki > kl || (ki == kl && ii > il);
+	  // increasing or decreasing bitonic sequence
+	  if (greater == ((i & k) == 0)){
+	    loc_keys[i]=kl;
+	    loc_keys[l]=ki;
+	    loc_index[i]=il;
+	    loc_index[l]=ii;
+	  }
+	}
+      }
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for(int i=it;i<n;i+=items){
+    d_Keys[i]=loc_keys[i];
+  }
+
+#ifdef PERMUT
+  // apply the sorting permutation to the permutation
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for(int i=it;i<n;i+=items){
+    loc_keys[i]=d_Permut[loc_index[i]];
+  }
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+  for(int i=it;i<n;i+=items){
+    d_Permut[i]=loc_keys[i];
+  }
+#endif
+
+}
+
+// verification of the sort: d_result[0] is the first index i with
+// key[i] > key[i+1] (initialized to n) and d_result[1] the sum of
+// a hash of the keys (which does not depend on their order)
+__kernel void checkkeys(const __global keytype* d_Keys,
+			const int n,
+			__global uint* d_result){
+
+  int ig = get_global_id(0);
+  int nbitems = get_global_size(0);
+
+  uint first=n;
+  uint sum=0;
+
+  for(int i=ig;i<n;i+=nbitems){
+    uint key=d_Keys[i];
+    if (i < n-1 && key > (uint) d_Keys[i+1]) first=min(first,(uint) i);
+    uint h=key * 0x9E3779B1u;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    sum += h;
+  }
+
+  if (first < n) atomic_min(d_result,first);
+  atomic_add(d_result+1,sum);
+
+}
+
+// primitives on lists of any length (class CLPrimitives)
+
+// scan of blocks of 2*items values: each group scans its block (as in
+// scanhistograms) and stores the sum of the block in d_blocksums
+// (inclusive or exclusive scan; with predicate, the values are replaced
+// by 1 if they are not zero, else 0); d_out can be d_in
+// (the sort keeps scanhistograms: its sizes are fixed multiples of the
+// block, without bounds checks, and it has a subgroup version)
+__kernel void scanblocks(const __global int* d_in,
+			 __global int* d_out,
+			 __global int* d_blocksums,
+			 __local int* temp,
+			 const int n,
+			 const int inclusive,
+			 const int predicate){
+
+  int it = get_local_id(0);
+  int gr = get_group_id(0);
+  int m = 2*get_local_size(0);
+  int decale = 1;
+
+  int i0 = gr*m+2*it;
+  int i1 = i0+1;
+
+  int a = (i0 < n) ? d_in[i0] : 0;
+  int b = (i1 < n) ? d_in[i1] : 0;
+  if (predicate) {
+    a = (a != 0);
+    b = (b != 0);
+  }
+
+  temp[2*it] = a;
+  temp[2*it+1] = b;
+
+  // up sweep
+  for (int d = m>>1; d > 0; d >>= 1){
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (it < d){
+      int ai = decale*(2*it+1)-1;
+      int bi = decale*(2*it+2)-1;
+      temp[bi] += temp[ai];
+    }
+    decale *= 2;
+  }
+
+  if (it == 0) {
+    d_blocksums[gr]=temp[m-1];
+    temp[m-1] = 0;
+  }
+
+  // down sweep
+  for (int d = 1; d < m; d *= 2){
+    decale >>= 1;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (it < d){
+      int ai = decale*(2*it+1)-1;
+      int bi = decale*(2*it+2)-1;
+      int t = temp[ai];
+      temp[ai] = temp[bi];
+      temp[bi] += t;
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (i0 < n) d_out[i0] = temp[2*it] + (inclusive ? a : 0);
+  if (i1 < n) d_out[i1] = temp[2*it+1] + (inclusive ? b : 0);
+
+}
+
+// add the scanned sums of the blocks to the blocks
+__kernel void addblocksums(__global int* d_out,
+			   const __global int* d_blocksums,
+			   const int n){
+
+  int ig = get_global_id(0);
+  int s = d_blocksums[get_group_id(0)];
+
+  if (2*ig < n) d_out[2*ig] += s;
+  if (2*ig+1 < n) d_out[2*ig+1] += s;
+
+}
+
+// d_histo[b] += number of keys equal to b (b < nbins, the larger keys
+// are ignored); with uselocal, each group counts in local memory first
+__kernel void histobins(const __global uint* d_keys,
+			const int n,
+			__global int* d_histo,
+			const int nbins,
+			__local int* loc_histo,
+			const int uselocal){
+
+  int it = get_local_id(0);
+  int ig = get_global_id(0);
+  int items = get_local_size(0);
+  int nbitems = get_global_size(0);
+
+  if (uselocal) {
+    for(int b=it;b<nbins;b+=items){
+      loc_histo[b]=0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(int k=ig;k<n;k+=nbitems){
+      uint key=d_keys[k];
+      if (key < nbins) atomic_inc(loc_histo+key);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(int b=it;b<nbins;b+=items){
+      if (loc_histo[b] != 0) atomic_add(d_histo+b,loc_histo[b]);
+    }
+  }
+  else {
+    for(int k=ig;k<n;k+=nbitems){
+      uint key=d_keys[k];
+      if (key < nbins) atomic_inc(d_histo+key);
+    }
+  }
+
+}
+
+// copy of the values whose flag is not zero at their position
+// (the exclusive scan of the flags)
+__kernel void compactscatter(const __global int* d_in,
+			     const __global int* d_flags,
+			     const __global int* d_pos,
+			     __global int* d_out,
+			     const int n){
+
+  int i = get_global_id(0);
+
+  if (i < n && d_flags[i] != 0) d_out[d_pos[i]]=d_in[i];
+
+}
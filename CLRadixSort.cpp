@@ -28,8 +28,9 @@ CLRadixSort::CLRadixSort(cl_context GPUContext,
 
   // check some conditions
   assert(_TOTALBITS % _BITS == 0);
-  assert(_N % (_GROUPS * _ITEMS) == 0);
-  assert( (_GROUPS * _ITEMS * _RADIX) % _HISTOSPLIT == 0);
+  assert(_TOTALBITS <= _KEYBITS);
+  assert(_N % _PADSIZE == 0);
+  assert( _HISTOSIZE % (2 * _HISTOSPLIT) == 0);
   assert(pow(2,(int) log2(_GROUPS)) == _GROUPS);
   assert(pow(2,(int) log2(_ITEMS)) == _ITEMS);
 
@@ -38,74 +39,46 @@ CLRadixSort::CLRadixSort(cl_context GPUContext,
   clGetDeviceInfo(dev, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMem), &localMem, NULL);
   if (VERBOSE) {
     cout << "Cache size="<<localMem <<" Bytes"<<endl;
-    cout << "Needed cache="<< sizeof(cl_uint)*_RADIX*_ITEMS <<" Bytes"<<endl;
+    cout << "Needed cache="<< sizeof(cl_uint)*_LOCALSIZE <<" Bytes"<<endl;
   }
-  assert(localMem > sizeof(cl_uint)*_RADIX*_ITEMS);
+  assert(localMem > sizeof(cl_uint)*_LOCALSIZE);
 
-  unsigned int maxmemcache=max(_HISTOSPLIT,_ITEMS * _GROUPS * _RADIX / _HISTOSPLIT);
+  unsigned int maxmemcache=max(_HISTOSPLIT,_HISTOSIZE / _HISTOSPLIT);
   assert(localMem > sizeof(cl_uint)*maxmemcache);
 
+  // keys and indices of the small sort (disabled if they do not fit)
+  assert(_SMALLSORT == 0 || pow(2,(int) log2(_SMALLSORT)) == _SMALLSORT);
+  smallsort=_SMALLSORT;
+  if (localMem <= 2*sizeof(cl_uint)*_SMALLSORT) {
+    smallsort=0;
+    if (VERBOSE) {
+      cout << "no small sort: "<<2*sizeof(cl_uint)*_SMALLSORT
+	   <<" Bytes of cache needed"<<endl;
+    }
+  }
+
 
   // init the timers
   histo_time=0;
   scan_time=0;
   reorder_time=0;
-  transpose_time=0;
+  select_time=0;
+  cell_time=0;
+  merge_time=0;
+  record_time=0;
+  pack_time=0;
+  maxkey_time=0;
+  small_time=0;
+  check_time=0;
+
+  npass=_PASS;
   
-  //read the program
-  string prog;   // program
-  string ligne;   // source file line reading
-  // kernel sources are in CLRadixsort.cl and we add at the beginning the
-  // file CLRadixSortParam.hpp
-  ifstream fichierprog("CLRadixSortParam.hpp",ios::in);
-  assert(fichierprog && "Le fichier n'existe pas");  
-  while(!fichierprog.eof()){
-    getline(fichierprog,ligne);
-    prog=prog+ligne+"\n";
-  }
-  fichierprog.close();
-
-  fichierprog.open("CLRadixSort.cl",ios::in);
-  assert(fichierprog && "Le fichier n'existe pas"); 
-  while(!fichierprog.eof()){
-    getline(fichierprog,ligne);
-    prog=prog+ligne+"\n";
-  }
-  fichierprog.close();
-
+  // the program is built once for the context and the device
+  // the kernels belong to the object
+  Program=CLProgramCache::Get(Context,NumDevice);
 
   cl_int err;
 
-  Program = clCreateProgramWithSource(Context, 1, (const char **)&prog, NULL, &err);
-  if (!Program) {
-    cout << "failed to create compute program" << endl;
-  }
-
-  assert(err == CL_SUCCESS);
-
-  // kernel compilation
-
-  // with flags
-  // #ifdef MAC
-  //     const char *flags = "-DMAC -cl-fast-relaxed-math";
-  // #else
-  //     const char *flags = "-cl-fast-relaxed-math";
-  // #endif
-  //   err = clBuildProgram(Program, 0, NULL, flags, NULL, NULL);
-
-  // without flag
-  err = clBuildProgram(Program, 0, NULL, NULL, NULL, NULL);
-  // if not successful display the errors 
-  if (err != CL_SUCCESS) { 
-    size_t len;
-    char buffer[2048];
-    cout << "failed to build program executable"<<endl;
-    clGetProgramBuildInfo(Program, NumDevice, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-    cout << endl<< buffer<<endl;
-    assert( err == CL_SUCCESS);
-  }
-
-
   ckHistogram = clCreateKernel(Program, "histogram", &err);
   assert(err == CL_SUCCESS);
   ckScanHistogram = clCreateKernel(Program, "scanhistograms", &err);
@@ -114,7 +87,27 @@ CLRadixSort::CLRadixSort(cl_context GPUContext,
   assert(err == CL_SUCCESS);
   ckReorder = clCreateKernel(Program, "reorder", &err);
   assert(err == CL_SUCCESS);
-  ckTranspose = clCreateKernel(Program, "transpose", &err);
+  ckSelectRadix = clCreateKernel(Program, "selectradix", &err);
+  assert(err == CL_SUCCESS);
+  ckTopK = clCreateKernel(Program, "topk", &err);
+  assert(err == CL_SUCCESS);
+  ckCellOffsets = clCreateKernel(Program, "celloffsets", &err);
+  assert(err == CL_SUCCESS);
+  ckMergePath = clCreateKernel(Program, "mergepath", &err);
+  assert(err == CL_SUCCESS);
+  ckRecordKeys = clCreateKernel(Program, "recordkeys", &err);
+  assert(err == CL_SUCCESS);
+  ckReorderRecords = clCreateKernel(Program, "reorderrecords", &err);
+  assert(err == CL_SUCCESS);
+  ckPackKeys = clCreateKernel(Program, "packkeys", &err);
+  assert(err == CL_SUCCESS);
+  ckCellKeys = clCreateKernel(Program, "cellkeys", &err);
+  assert(err == CL_SUCCESS);
+  ckMaxKey = clCreateKernel(Program, "maxkey", &err);
+  assert(err == CL_SUCCESS);
+  ckSmallSort = clCreateKernel(Program, "smallsort", &err);
+  assert(err == CL_SUCCESS);
+  ckCheckKeys = clCreateKernel(Program, "checkkeys", &err);
   assert(err == CL_SUCCESS);
    
 
@@ -132,90 +125,50 @@ CLRadixSort::CLRadixSort(cl_context GPUContext,
     h_Permut[i] = i;
   }
 
+  // allocate only the lists that are needed
+  devmem=0;
+  devmem_peak=0;
+
+  // the scratch lists (reordered keys and permutation, histograms)
+  // are taken in the pool of the context only during the computations
+  CLBufferPool::Register(Context);
+  scratch=false;
+  d_outKeys=NULL;
+  d_outPermut=NULL;
+  d_Histograms=NULL;
+  d_globsum=NULL;
+  d_temp=NULL;
+  d_selKeys=NULL;
+
   // copy on the GPU
   cout << "Send to the GPU"<<endl;
-  d_inKeys  = clCreateBuffer(Context,
-			     CL_MEM_READ_WRITE,
-			     sizeof(uint)* _N ,
-			     NULL,
-			     &err);
-  assert(err == CL_SUCCESS);
-
-  d_outKeys  = clCreateBuffer(Context,
-			      CL_MEM_READ_WRITE,
-			      sizeof(uint)* _N ,
-			      NULL,
-			      &err);
-  assert(err == CL_SUCCESS);
-
-  d_inPermut  = clCreateBuffer(Context,
-			       CL_MEM_READ_WRITE,
-			       sizeof(uint)* _N ,
-			       NULL,
-			       &err);
-  assert(err == CL_SUCCESS);
+  d_inKeys=CreateBuffer(sizeof(keytype)* _N);
 
-  d_outPermut  = clCreateBuffer(Context,
-				CL_MEM_READ_WRITE,
-				sizeof(uint)* _N ,
-				NULL,
-				&err);
-  assert(err == CL_SUCCESS);
+  // the permutation is stored only if needed
+  d_inPermut=NULL;
+#ifdef PERMUT
+  d_inPermut=CreateBuffer(sizeof(uint)* _N);
+#endif
 
   // copy the keys and the permutation to the GPU
   Host2GPU();
 
+  // counters for the radix selection
+  d_selCount=CreateBuffer(sizeof(uint)* 2);
 
-  // allocate the histogram on the GPU
-  d_Histograms  = clCreateBuffer(Context,
-				 CL_MEM_READ_WRITE,
-				 sizeof(uint)* _RADIX * _GROUPS * _ITEMS,
-				 NULL,
-				 &err);
-  assert(err == CL_SUCCESS);
-
-
-  // allocate the auxiliary histogram on GPU
-  d_globsum  = clCreateBuffer(Context,
-			      CL_MEM_READ_WRITE,
-			      sizeof(uint)* _HISTOSPLIT,
-			      NULL,
-			      &err);
-  assert(err == CL_SUCCESS);
+  // no cells offsets by default
+  ncells=0;
+  d_CellOffsets=NULL;
+  histo0=false;
 
-  // temporary vector when the sum is not needed
-  d_temp  = clCreateBuffer(Context,
-			   CL_MEM_READ_WRITE,
-			   sizeof(uint)* _HISTOSPLIT,
-			   NULL,
-			   &err);
-  assert(err == CL_SUCCESS);
+  curpass=-1;
 
   Resize(nkeys);
 
 
-  // we set here the fixed arguments of the OpenCL kernels
-  // the changing arguments are modified elsewhere in the class
-  err = clSetKernelArg(ckHistogram, 1, sizeof(cl_mem), &d_Histograms);
-  assert(err == CL_SUCCESS);
-
-  err = clSetKernelArg(ckHistogram, 3, sizeof(uint)*_RADIX*_ITEMS, NULL);
-  assert(err == CL_SUCCESS);
-
-  err = clSetKernelArg(ckPasteHistogram, 0, sizeof(cl_mem), &d_Histograms);
-  assert(err == CL_SUCCESS);
-
-  err = clSetKernelArg(ckPasteHistogram, 1, sizeof(cl_mem), &d_globsum);
-  assert(err == CL_SUCCESS);
-
-  err = clSetKernelArg(ckReorder, 2, sizeof(cl_mem), &d_Histograms);
-  assert(err == CL_SUCCESS);
-
-  err  = clSetKernelArg(ckReorder, 6,
-			sizeof(uint)* _RADIX * _ITEMS ,
-			NULL); // local cache memory
-  assert(err == CL_SUCCESS);
-
+  if (VERBOSE) {
+    cout << "Device memory="<<devmem<<" Bytes"<<endl;
+  }
 
 }
 
@@ -229,184 +182,156 @@ void CLRadixSort::Resize(int nn){
   }
   nkeys=nn;
 
-  // length of the vector has to be divisible by (_GROUPS * _ITEMS)
-  int reste=nkeys % (_GROUPS * _ITEMS);
+  // length of the vector has to be divisible by _PADSIZE
+  int reste=nkeys % _PADSIZE;
   nkeys_rounded=nkeys;
   cl_int err;
-  unsigned int pad[_GROUPS * _ITEMS];
-  for(int ii=0;ii<_GROUPS * _ITEMS;ii++){
-    pad[ii]=_MAXINT-(unsigned int)1;
+  cl_event eve;
+  keytype pad[_PADSIZE];
+  for(int ii=0;ii<_PADSIZE;ii++){
+    pad[ii]=_KEYMASK;
   }
   if (reste !=0) {
-    nkeys_rounded=nkeys-reste+(_GROUPS * _ITEMS);
+    nkeys_rounded=nkeys-reste+_PADSIZE;
     // pad the vector with big values
     assert(nkeys_rounded <= _N);
     err = clEnqueueWriteBuffer(CommandQueue,
 			       d_inKeys,
-			       CL_TRUE, sizeof(uint)*nkeys,
-			       sizeof(uint) *(_GROUPS * _ITEMS - reste) ,
+			       CL_TRUE, sizeof(keytype)*nkeys,
+			       sizeof(keytype) *(_PADSIZE - reste) ,
 			       pad,
-			       0, NULL, NULL);
+			       0, NULL, &eve);
     //cout << nkeys<<" "<<nkeys_rounded<<endl;
     assert(err == CL_SUCCESS);   
+    Trace(eve,"padding",sizeof(keytype) *(_PADSIZE - reste));
+    clReleaseEvent(eve);
   }
 
 }
 
-// transpose the list for faster memory access
-void CLRadixSort::Transpose(int nbrow,int nbcol){
+// global sorting algorithm
 
-#define _TRANSBLOCK 32 // size of the matrix block loaded into local memeory
+void CLRadixSort::Sort(uint maxkey){
 
+  assert(nkeys_rounded <= _N);
+  assert(nkeys <= nkeys_rounded);
+  if (VERBOSE){
+    cout << "Start storting "<<nkeys<< " keys"<<endl;
+  }
 
-  int tilesize=_TRANSBLOCK;
+  // only the passes of the digits of maxkey are needed
+  // (the padding keys remain at the end because their
+  // low bits are all ones)
+  npass=1;
+  while(npass < _PASS && (maxkey >> (npass * _BITS)) != 0) npass++;
 
-  // if the matrix is too small, avoid using local memory
-  if (nbrow%tilesize != 0) tilesize=1;
-  if (nbcol%tilesize != 0) tilesize=1;
+  // small list: a single kernel launch
+  if (nkeys <= smallsort) {
+    if (VERBOSE) {
+      cout << "Small sort"<<endl;
+    }
+    SmallSort();
+  }
+  else {
+    AcquireScratch();
+
+    // with TRANSPOSE, the first pass reads the natural order and the
+    // last pass writes it: the list is not transposed before and after
+    for(uint pass=0;pass<npass;pass++){
+      if (VERBOSE) {
+	cout << "pass "<<pass<<endl;
+      }
+      if (VERBOSE) {
+	cout << "Build histograms "<<endl;
+      }
+      curpass=pass;
+      if (pass > 0 || !histo0) Histogram(pass);
+      if (VERBOSE) {
+	cout << "Scan histograms "<<endl;
+      }
+      ScanHistogram();
+      if (VERBOSE) {
+	cout << "Reorder "<<endl;
+      }
+      Reorder(pass);
+    }
+    curpass=-1;
+  }
 
-  if (tilesize == 1) {
-    cout << "Warning, small list, avoiding cache..."<<endl;
+  if (ncells > 0) {
+    if (VERBOSE) {
+      cout << "Cells offsets"<<endl;
+    }
+    CellOffsets();
   }
 
-  cl_int err;
+  // keep the histograms for the display (operator<<, Check)
+  if (VERBOSE && scratch) RecupHistograms();
 
-  err  = clSetKernelArg(ckTranspose, 0, sizeof(cl_mem), &d_inKeys);
-  assert(err == CL_SUCCESS);
+  ReleaseScratch();
+  histo0=false;
 
-  err  = clSetKernelArg(ckTranspose, 1, sizeof(cl_mem), &d_outKeys);
-  assert(err == CL_SUCCESS);
+  sort_time=histo_time+scan_time+reorder_time+cell_time+small_time;
+  if (VERBOSE){
+    cout << "End sorting"<<endl;
+  }
+}
 
-  err = clSetKernelArg(ckTranspose, 2, sizeof(uint), &nbcol);
-  assert(err == CL_SUCCESS);
+// sort of a small list by one work group in local memory
+void CLRadixSort::SmallSort(void){
 
-  err = clSetKernelArg(ckTranspose, 3, sizeof(uint), &nbrow);
-  assert(err == CL_SUCCESS);
+  assert(nkeys <= smallsort);
 
-  err  = clSetKernelArg(ckTranspose, 4, sizeof(cl_mem), &d_inPermut);
-  assert(err == CL_SUCCESS);
+  cl_int err;
 
-  err  = clSetKernelArg(ckTranspose, 5, sizeof(cl_mem), &d_outPermut);
+  err  = clSetKernelArg(ckSmallSort, 0, sizeof(cl_mem), &d_inKeys);
   assert(err == CL_SUCCESS);
 
-  err  = clSetKernelArg(ckTranspose, 6, sizeof(uint)*tilesize*tilesize, NULL);
+  err  = clSetKernelArg(ckSmallSort, 1, sizeof(cl_mem), &d_inPermut);
   assert(err == CL_SUCCESS);
 
-  err  = clSetKernelArg(ckTranspose, 7, sizeof(uint)*tilesize*tilesize, NULL);
+  err = clSetKernelArg(ckSmallSort, 2, sizeof(uint), &nkeys);
   assert(err == CL_SUCCESS);
 
-  err = clSetKernelArg(ckTranspose, 8, sizeof(uint), &tilesize);
+  err  = clSetKernelArg(ckSmallSort, 3, sizeof(uint)*_SMALLSORT, NULL);
   assert(err == CL_SUCCESS);
 
-  cl_event eve;
-
-  size_t global_work_size[2];
-  size_t local_work_size[2];
-
-  assert(nbrow%tilesize == 0);
-  assert(nbcol%tilesize == 0);
-
-  global_work_size[0]=nbrow/tilesize;
-  global_work_size[1]=nbcol;
+  err  = clSetKernelArg(ckSmallSort, 4, sizeof(uint)*_SMALLSORT, NULL);
+  assert(err == CL_SUCCESS);
 
-  local_work_size[0]=1;
-  local_work_size[1]=tilesize;
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=_ITEMS;
 
+  cl_event eve;
 
   err = clEnqueueNDRangeKernel(CommandQueue,
-			       ckTranspose,
-			       2,   // two dimensions: rows and columns
- 			       NULL,
-			       global_work_size,
-			       local_work_size,
+			       ckSmallSort,
+			       1, NULL,
+			       &nbitems,
+			       &nblocitems,
 			       0, NULL, &eve);
-
-  //exchange the pointers
-
-  // swap the old and new vectors of keys
-  cl_mem d_temp;
-  d_temp=d_inKeys;
-  d_inKeys=d_outKeys;
-  d_outKeys=d_temp;
-
-  // swap the old and new permutations
-  d_temp=d_inPermut;
-  d_inPermut=d_outPermut;
-  d_outPermut=d_temp;
-
-
-  // timing
+  assert(err== CL_SUCCESS);
   clFinish(CommandQueue);
 
   cl_ulong debut,fin;
 
   err=clGetEventProfilingInfo (eve,
-			   CL_PROFILING_COMMAND_QUEUED,
-			   sizeof(cl_ulong),
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
 			       (void*) &debut,
-			   NULL);
+			       NULL);
   assert(err== CL_SUCCESS);
 
   err=clGetEventProfilingInfo (eve,
-			   CL_PROFILING_COMMAND_END,
-			   sizeof(cl_ulong),
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
 			       (void*) &fin,
-			   NULL);
+			       NULL);
   assert(err== CL_SUCCESS);
 
-  transpose_time += (float) (fin-debut)/1e9;
-
-}
-
-// global sorting algorithm
-
-void CLRadixSort::Sort(){
-
-  assert(nkeys_rounded <= _N);
-  assert(nkeys <= nkeys_rounded);
-  int nbcol=nkeys_rounded/(_GROUPS * _ITEMS);
-  int nbrow= _GROUPS * _ITEMS;
-
-  if (VERBOSE){
-    cout << "Start storting "<<nkeys<< " keys"<<endl;
-  }
-
-#ifdef TRANSPOSE
-    if (VERBOSE) {
-      cout << "Transpose"<<endl;
-    }
-    Transpose(nbrow,nbcol);
-#endif
-
-  for(uint pass=0;pass<_PASS;pass++){
-    if (VERBOSE) {
-      cout << "pass "<<pass<<endl;
-    }
-    if (VERBOSE) {
-      cout << "Build histograms "<<endl;
-    }
-    Histogram(pass);
-    if (VERBOSE) {
-      cout << "Scan histograms "<<endl;
-    }
-    ScanHistogram();
-    if (VERBOSE) {
-      cout << "Reorder "<<endl;
-    }
-    Reorder(pass);
-  }
-
-#ifdef TRANSPOSE
-    if (VERBOSE) {
-      cout << "Transpose"<<endl;
-    }
-    Transpose(nbcol,nbrow);
-#endif
+  small_time += (float) (fin-debut)/1e9;
+  Trace(eve,"smallsort");
 
-  sort_time=histo_time+scan_time+reorder_time+transpose_time;
-  if (VERBOSE){
-    cout << "End sorting"<<endl;
-  }
 }
 
 
@@ -442,6 +367,104 @@ void CLRadixSort::Check(){
 
 }
 
+// first unsorted index and checksum of the keys (on the device)
+void CLRadixSort::CheckKeys(uint* result){
+
+  cl_int err;
+
+  // no violation found yet, zero checksum
+  uint init[2]={nkeys,0};
+  err = clEnqueueWriteBuffer(CommandQueue,
+			     d_selCount,
+			     CL_TRUE, 0,
+			     sizeof(uint) * 2,
+			     init,
+			     0, NULL, NULL);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckCheckKeys, 0, sizeof(cl_mem), &d_inKeys);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckCheckKeys, 1, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckCheckKeys, 2, sizeof(cl_mem), &d_selCount);
+  assert(err == CL_SUCCESS);
+
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=_GROUPS*_ITEMS;
+
+  cl_event eve;
+
+  err = clEnqueueNDRangeKernel(CommandQueue,
+			       ckCheckKeys,
+			       1, NULL,
+			       &nbitems,
+			       &nblocitems,
+			       0, NULL, &eve);
+  assert(err== CL_SUCCESS);
+  clFinish(CommandQueue);
+
+  cl_ulong debut,fin;
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
+			       (void*) &debut,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
+			       (void*) &fin,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  check_time += (float) (fin-debut)/1e9;
+  Trace(eve,"checkkeys");
+
+  err = clEnqueueReadBuffer(CommandQueue,
+			    d_selCount,
+			    CL_TRUE, 0,
+			    sizeof(uint) * 2,
+			    result,
+			    0, NULL, NULL);
+  assert(err == CL_SUCCESS);
+
+}
+
+// order-independent checksum of the keys
+uint CLRadixSort::KeysChecksum(void){
+
+  uint result[2];
+  CheckKeys(result);
+
+  return result[1];
+
+}
+
+// check the sort without reading the list
+bool CLRadixSort::DeviceCheck(uint checksum,uint* firstviolation){
+
+  uint result[2];
+  CheckKeys(result);
+
+  if (firstviolation != NULL) *firstviolation=result[0];
+
+  if (VERBOSE) {
+    if (result[0] < nkeys) {
+      cout << "erreur tri "<<result[0]<<endl;
+    }
+    if (result[1] != checksum) {
+      cout << "erreur checksum "<<result[1]<<" != "<<checksum<<endl;
+    }
+  }
+
+  return result[0] == nkeys && result[1] == checksum;
+
+}
+
 void CLRadixSort::PICSorting(void){
 
   // allocate positions and velocities of particles
@@ -456,22 +479,28 @@ void CLRadixSort::PICSorting(void){
     up[j]=corput(j,2,5);
     vp[j]=corput(j,3,7);
     h_Permut[j]=j;
-    // compute the cell number
-    int ix=floor(xp[j]*32);
-    int iy=floor(yp[j]*32);
-    assert(ix>=0 && ix<32);
-    assert(iy>=0 && iy<32);
-    int k=32*ix+iy;
-    h_Keys[j]=k;
   }
 
-  Host2GPU();
+  // the keys (cells numbers 32*ix+iy) are computed on the device
+  // from the positions
+  cl_mem d_x=CreateBuffer(sizeof(float)*_N);
+  cl_mem d_y=CreateBuffer(sizeof(float)*_N);
+  cl_int status;
+  status = clEnqueueWriteBuffer(CommandQueue,d_x,CL_TRUE,0,
+				sizeof(float)*_N,xp,0,NULL,NULL);
+  assert (status == CL_SUCCESS);
+  status = clEnqueueWriteBuffer(CommandQueue,d_y,CL_TRUE,0,
+				sizeof(float)*_N,yp,0,NULL,NULL);
+  assert (status == CL_SUCCESS);
 
   // init the timers
   histo_time=0;
   scan_time=0;
   reorder_time=0;
-  transpose_time=0;
+  cell_time=0;
+
+  bool ok=CellKeys(d_x,d_y,_N,0,0,1./32,1./32,32,32,false,true);
+  assert(ok);
 
   cout << "GPU first sorting"<<endl;
   Sort();
@@ -479,11 +508,28 @@ void CLRadixSort::PICSorting(void){
   cout << histo_time<<" s in the histograms"<<endl;
   cout << scan_time<<" s in the scanning"<<endl;
   cout << reorder_time<<" s in the reordering"<<endl;
-  cout << transpose_time<<" s in the transposition"<<endl;
+  cout << cell_time<<" s in the cells offsets"<<endl;
   cout << sort_time <<" s total GPU time (without memory transfers)"<<endl;
 
   RecupGPU();
 
+  cout << "Check the cells offsets"<<endl;
+  vector<uint> offsets(ncells+1);
+  status = clEnqueueReadBuffer( CommandQueue,
+				d_CellOffsets,
+				CL_TRUE, 0,
+				sizeof(uint)  * (ncells+1),
+				&offsets[0],
+				0, NULL, NULL );
+  assert (status == CL_SUCCESS);
+  assert(offsets[0] == 0);
+  assert(offsets[ncells] == nkeys);
+  for(uint c=0;c<ncells;c++){
+    for(uint i=offsets[c];i<offsets[c+1];i++){
+      assert(h_Keys[i] == c);
+    }
+  }
+
   cout << "Reorder particles"<<endl;
 
   for(int j=0;j<_N;j++){
@@ -500,23 +546,23 @@ void CLRadixSort::PICSorting(void){
     xp[j]=xp[j]-floor(xp[j]);
     yp[j]=ys[j]+delta*vs[j]/32;
     yp[j]=yp[j]-floor(yp[j]);
-    h_Permut[j]=j;
-    // compute the cell number
-    int ix=floor(xp[j]*32);
-    int iy=floor(yp[j]*32);
-    assert(ix>=0 && ix<32);
-    assert(iy>=0 && iy<32);
-    int k=32*ix+iy;
-    h_Keys[j]=k;
   }
-  
-  Host2GPU();
+
+  status = clEnqueueWriteBuffer(CommandQueue,d_x,CL_TRUE,0,
+				sizeof(float)*_N,xp,0,NULL,NULL);
+  assert (status == CL_SUCCESS);
+  status = clEnqueueWriteBuffer(CommandQueue,d_y,CL_TRUE,0,
+				sizeof(float)*_N,yp,0,NULL,NULL);
+  assert (status == CL_SUCCESS);
 
   // init the timers
   histo_time=0;
   scan_time=0;
   reorder_time=0;
-  transpose_time=0;
+  cell_time=0;
+
+  ok=CellKeys(d_x,d_y,_N,0,0,1./32,1./32,32,32,false,true);
+  assert(ok);
 
   cout << "GPU second sorting"<<endl;
 
@@ -525,9 +571,11 @@ void CLRadixSort::PICSorting(void){
   cout << histo_time<<" s in the histograms"<<endl;
   cout << scan_time<<" s in the scanning"<<endl;
   cout << reorder_time<<" s in the reordering"<<endl;
-  cout << transpose_time<<" s in the transposition"<<endl;
+  cout << cell_time<<" s in the cells offsets"<<endl;
   cout << sort_time <<" s total GPU time (without memory transfers)"<<endl;
 
+  ReleaseBuffer(d_x);
+  ReleaseBuffer(d_y);
 
 }
 
@@ -537,14 +585,30 @@ CLRadixSort::~CLRadixSort()
   clReleaseKernel(ckScanHistogram);
   clReleaseKernel(ckPasteHistogram);
   clReleaseKernel(ckReorder);
-  clReleaseKernel(ckTranspose);
+  clReleaseKernel(ckSelectRadix);
+  clReleaseKernel(ckTopK);
+  clReleaseKernel(ckCellOffsets);
+  clReleaseKernel(ckMergePath);
+  clReleaseKernel(ckRecordKeys);
+  clReleaseKernel(ckReorderRecords);
+  clReleaseKernel(ckPackKeys);
+  clReleaseKernel(ckCellKeys);
+  clReleaseKernel(ckMaxKey);
+  clReleaseKernel(ckSmallSort);
+  clReleaseKernel(ckCheckKeys);
   clReleaseProgram(Program);
-  clReleaseMemObject(d_inKeys);  // to do: more clever memory deallocation
-  clReleaseMemObject(d_outKeys);
-  clReleaseMemObject(d_Histograms);
-  clReleaseMemObject(d_globsum);
-  clReleaseMemObject(d_inPermut); // to do: more clever memory deallocation
-  clReleaseMemObject(d_outPermut);
+  ReleaseScratch();
+  ReleaseBuffer(d_inKeys);
+  ReleaseBuffer(d_inPermut);
+  ReleaseBuffer(d_selCount);
+  ReleaseBuffer(d_CellOffsets);
+  CLBufferPool::Unregister(Context);
+#ifdef TRACE
+  // the commands not written
+  for(uint i=0;i<trace.size();i++){
+    clReleaseEvent(trace[i].eve);
+  }
+#endif
 };
 
 
@@ -552,33 +616,54 @@ CLRadixSort::~CLRadixSort()
 void CLRadixSort::RecupGPU(void){
 
   cl_int status;
+  cl_event eve;
 
   clFinish(CommandQueue);  // wait end of read
 
   status = clEnqueueReadBuffer( CommandQueue,
 				d_inKeys,
 				CL_TRUE, 0, 
-				sizeof(uint)  * _N,
+				sizeof(keytype)  * nkeys,
 				h_Keys,
-				0, NULL, NULL ); 
+				0, NULL, &eve ); 
  
   assert (status == CL_SUCCESS);
+  Trace(eve,"recupgpu keys",sizeof(keytype)  * nkeys);
+  clReleaseEvent(eve);
   clFinish(CommandQueue);  // wait end of read
 
+#ifdef PERMUT
   status = clEnqueueReadBuffer( CommandQueue,
 				d_inPermut,
 				CL_TRUE, 0, 
-				sizeof(uint)  * _N,
+				sizeof(uint)  * nkeys,
 				h_Permut,
-				0, NULL, NULL ); 
+				0, NULL, &eve ); 
  
   assert (status == CL_SUCCESS);
+  Trace(eve,"recupgpu permut",sizeof(uint)  * nkeys);
+  clReleaseEvent(eve);
+  clFinish(CommandQueue);  // wait end of read
+#endif
+
+  // the histograms are available only until the end of the sort
+  // (after, they are given back to the pool)
+  if (scratch) RecupHistograms();
+
   clFinish(CommandQueue);  // wait end of read
+}
+
+// get the histograms of the last pass (while the scratch lists are held)
+void CLRadixSort::RecupHistograms(void){
+
+  cl_int status;
+
+  assert(scratch);
 
   status = clEnqueueReadBuffer( CommandQueue,
 				d_Histograms,
 				CL_TRUE, 0, 
-				sizeof(uint)  * _RADIX * _GROUPS * _ITEMS,
+				sizeof(uint)  * _HISTOSIZE,
 				h_Histograms,
 				0, NULL, NULL );  
   assert (status == CL_SUCCESS);
@@ -591,33 +676,213 @@ void CLRadixSort::RecupGPU(void){
 				0, NULL, NULL );  
   assert (status == CL_SUCCESS);
 
-  clFinish(CommandQueue);  // wait end of read
+}
+
+// read a range of the list (non blocking)
+cl_event CLRadixSort::RecupKeys(uint first,uint count,
+				keytype* keys,uint* permut,
+				cl_command_queue queue){
+
+  if (queue == NULL) queue=CommandQueue;
+
+  assert(first+count <= nkeys);
+
+  cl_int err;
+  cl_event eve;
+
+  err = clEnqueueReadBuffer(queue,
+			    d_inKeys,
+			    CL_FALSE, sizeof(keytype) * first,
+			    sizeof(keytype) * count,
+			    keys,
+			    0, NULL, &eve);
+  assert(err == CL_SUCCESS);
+  Trace(eve,"recupkeys",sizeof(keytype) * count);
+
+  if (permut != NULL) {
+#ifdef PERMUT
+    // the queue is in order: the last event is the end of both
+    clReleaseEvent(eve);
+    err = clEnqueueReadBuffer(queue,
+			      d_inPermut,
+			      CL_FALSE, sizeof(uint) * first,
+			      sizeof(uint) * count,
+			      permut,
+			      0, NULL, &eve);
+    assert(err == CL_SUCCESS);
+    Trace(eve,"recuppermut",sizeof(uint) * count);
+#else
+    assert(permut == NULL && "the permutation needs PERMUT");
+#endif
+  }
+
+  clFlush(queue);
+
+  return eve;
+
+}
+
+// write a range of the list (non blocking)
+cl_event CLRadixSort::SendKeys(uint first,uint count,
+			       const keytype* keys,const uint* permut,
+			       cl_command_queue queue){
+
+  if (queue == NULL) queue=CommandQueue;
+
+  assert(first+count <= nkeys);
+
+  cl_int err;
+  cl_event eve;
+
+  err = clEnqueueWriteBuffer(queue,
+			     d_inKeys,
+			     CL_FALSE, sizeof(keytype) * first,
+			     sizeof(keytype) * count,
+			     keys,
+			     0, NULL, &eve);
+  assert(err == CL_SUCCESS);
+  Trace(eve,"sendkeys",sizeof(keytype) * count);
+
+  if (permut != NULL) {
+#ifdef PERMUT
+    clReleaseEvent(eve);
+    err = clEnqueueWriteBuffer(queue,
+			       d_inPermut,
+			       CL_FALSE, sizeof(uint) * first,
+			       sizeof(uint) * count,
+			       permut,
+			       0, NULL, &eve);
+    assert(err == CL_SUCCESS);
+    Trace(eve,"sendpermut",sizeof(uint) * count);
+#else
+    assert(permut == NULL && "the permutation needs PERMUT");
+#endif
+  }
+
+  clFlush(queue);
+
+  return eve;
+
 }
 
 // put the data to the GPU
 void CLRadixSort::Host2GPU(void){
 
   cl_int status;
+  cl_event eve;
 
   status = clEnqueueWriteBuffer( CommandQueue,
 				d_inKeys,
 				CL_TRUE, 0, 
-				sizeof(uint)  * _N,
+				sizeof(keytype)  * nkeys,
 				h_Keys,
-				0, NULL, NULL ); 
+				0, NULL, &eve ); 
  
   assert (status == CL_SUCCESS);
+  Trace(eve,"host2gpu keys",sizeof(keytype)  * nkeys);
+  clReleaseEvent(eve);
   clFinish(CommandQueue);  // wait end of read
 
+#ifdef PERMUT
   status = clEnqueueWriteBuffer( CommandQueue,
 				d_inPermut,
 				CL_TRUE, 0, 
-				sizeof(uint)  * _N,
+				sizeof(uint)  * nkeys,
 				h_Permut,
-				0, NULL, NULL ); 
+				0, NULL, &eve ); 
  
   assert (status == CL_SUCCESS);
+  Trace(eve,"host2gpu permut",sizeof(uint)  * nkeys);
+  clReleaseEvent(eve);
   clFinish(CommandQueue);  // wait end of read
+#endif
+
+}
+
+// record a command for the trace
+void CLRadixSort::Trace(cl_event eve,const char* name,size_t bytes){
+
+#ifdef TRACE
+  // the record is limited (e.g. a time loop without WriteTrace):
+  // the next commands are not recorded
+  if (trace.size() >= _TRACEMAX) return;
+  // the times are read when the trace is written
+  clRetainEvent(eve);
+  TraceEvent te;
+  te.eve=eve;
+  te.name=name;
+  te.pass=curpass;
+  te.nkeys=nkeys;
+  te.bytes=bytes;
+  trace.push_back(te);
+#else
+  (void) eve;
+  (void) name;
+  (void) bytes;
+#endif
+
+}
+
+// write the recorded commands in the Chrome trace format
+// (one line for the kernels, one for the transfers and one for
+// the waiting times in the queues, in microseconds)
+void CLRadixSort::WriteTrace(const char* filename){
+
+  ofstream out(filename);
+  assert(out);
+
+  out << "{\"traceEvents\":["<<endl;
+  const char* lines[3]={"kernels","transfers","queued"};
+  for(int l=0;l<3;l++){
+    out << (l > 0 ? ",\n" : "")
+	<<"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":"<<l
+	<<",\"args\":{\"name\":\""<<lines[l]<<"\"}}";
+  }
+
+#ifdef TRACE
+  if (trace.size() >= _TRACEMAX) {
+    cout << "trace full: only the first "<<_TRACEMAX<<" commands are written"<<endl;
+  }
+  cl_profiling_info info[4]={CL_PROFILING_COMMAND_QUEUED,CL_PROFILING_COMMAND_SUBMIT,
+			     CL_PROFILING_COMMAND_START,CL_PROFILING_COMMAND_END};
+  vector<cl_ulong> t(4*trace.size());
+  vector<bool> valid(trace.size());
+  cl_ulong t0=0;
+  for(uint i=0;i<trace.size();i++){
+    clWaitForEvents(1,&trace[i].eve);
+    valid[i]=true;
+    // (no times if the queue of the command has no profiling)
+    for(int q=0;q<4;q++){
+      cl_int err=clGetEventProfilingInfo(trace[i].eve,info[q],sizeof(cl_ulong),
+					 &t[4*i+q],NULL);
+      valid[i] = valid[i] && (err == CL_SUCCESS);
+    }
+    if (valid[i] && (t0 == 0 || t[4*i] < t0)) t0=t[4*i];
+    clReleaseEvent(trace[i].eve);
+  }
+
+  out.precision(15);
+  for(uint i=0;i<trace.size();i++){
+    if (!valid[i]) continue;
+    TraceEvent& te=trace[i];
+    int tid= (te.bytes > 0) ? 1 : 0;
+    out << ",\n{\"name\":\""<<te.name<<"\",\"cat\":\""<<lines[tid]
+	<<"\",\"ph\":\"X\",\"pid\":0,\"tid\":"<<tid
+	<<",\"ts\":"<<(t[4*i+2]-t0)/1e3<<",\"dur\":"<<(t[4*i+3]-t[4*i+2])/1e3
+	<<",\"args\":{\"keys\":"<<te.nkeys;
+    if (te.pass >= 0) out << ",\"pass\":"<<te.pass;
+    if (te.bytes > 0) out << ",\"bytes\":"<<te.bytes;
+    out << ",\"queued\":"<<(t[4*i]-t0)/1e3<<",\"submit\":"<<(t[4*i+1]-t0)/1e3
+	<<"}}";
+    out << ",\n{\"name\":\""<<te.name<<"\",\"cat\":\"queued\",\"ph\":\"X\",\"pid\":0,\"tid\":2"
+	<<",\"ts\":"<<(t[4*i]-t0)/1e3<<",\"dur\":"<<(t[4*i+2]-t[4*i])/1e3<<"}";
+  }
+  trace.clear();
+#else
+  cout << "no trace: define TRACE in CLRadixSortParam.hpp"<<endl;
+#endif
+
+  out << endl<<"]}"<<endl;
 
 }
 
@@ -628,9 +893,13 @@ ostream& operator<<(ostream& os,  CLRadixSort &radi){
 
   for(uint rad=0;rad<_RADIX;rad++){
     for(uint gr=0;gr<_GROUPS;gr++){
+#ifdef LOCALATOMIC
+      os <<"Radix="<<rad<<" Group="<<gr<<" Histo="<<radi.h_Histograms[_GROUPS * rad + gr]<<endl;
+#else
       for(uint it=0;it<_ITEMS;it++){
 	os <<"Radix="<<rad<<" Group="<<gr<<" Item="<<it<<" Histo="<<radi.h_Histograms[_GROUPS * _ITEMS * rad +_ITEMS * gr+it]<<endl;
       }
+#endif
     }
   }
   os<<endl;
@@ -670,7 +939,7 @@ void CLRadixSort::Histogram(uint pass){
   err = clSetKernelArg(ckHistogram, 2, sizeof(uint), &pass);
   assert(err == CL_SUCCESS);
 
-  assert( nkeys_rounded%(_GROUPS * _ITEMS) == 0);
+  assert( nkeys_rounded%_PADSIZE == 0);
   assert( nkeys_rounded <= _N);
 
   err = clSetKernelArg(ckHistogram, 4, sizeof(uint), &nkeys_rounded);
@@ -707,6 +976,7 @@ void CLRadixSort::Histogram(uint pass){
   assert(err== CL_SUCCESS);
 
   histo_time += (float) (fin-debut)/1e9;
+  Trace(eve,"histogram");
 
 
 }
@@ -718,13 +988,13 @@ void CLRadixSort::ScanHistogram(void){
 
   // numbers of processors for the local scan
   // = half the size of the local histograms
-  size_t nbitems=_RADIX* _GROUPS*_ITEMS / 2;
+  size_t nbitems=_HISTOSIZE / 2;
 
 
   size_t nblocitems= nbitems/_HISTOSPLIT ;
 
 
-  int maxmemcache=max(_HISTOSPLIT,_ITEMS * _GROUPS * _RADIX / _HISTOSPLIT);
+  int maxmemcache=max(_HISTOSPLIT,_HISTOSIZE / _HISTOSPLIT);
 
   // scan locally the histogram (the histogram is split into several
   // parts that fit into the local memory)
@@ -768,6 +1038,7 @@ void CLRadixSort::ScanHistogram(void){
   assert(err== CL_SUCCESS);
 
   scan_time += (float) (fin-debut)/1e9;
+  Trace(eve,"scanhistograms");
 
   // second scan for the globsum
   err = clSetKernelArg(ckScanHistogram, 0, sizeof(cl_mem), &d_globsum);
@@ -804,10 +1075,11 @@ void CLRadixSort::ScanHistogram(void){
   assert(err== CL_SUCCESS);
 
   scan_time += (float) (fin-debut)/1e9;
+  Trace(eve,"scanhistograms");
 
 
   // loops again in order to paste together the local histograms
-  nbitems = _RADIX* _GROUPS*_ITEMS/2;
+  nbitems = _HISTOSIZE/2;
   nblocitems=nbitems/_HISTOSPLIT;
 
   err = clEnqueueNDRangeKernel(CommandQueue,
@@ -835,6 +1107,7 @@ void CLRadixSort::ScanHistogram(void){
   assert(err== CL_SUCCESS);
 
   scan_time += (float) (fin-debut)/1e9;
+  Trace(eve,"pastehistograms");
 
 
 }
@@ -854,86 +1127,2115 @@ void CLRadixSort::Reorder(uint pass){
   err  = clSetKernelArg(ckReorder, 0, sizeof(cl_mem), &d_inKeys);
   assert(err == CL_SUCCESS);
 
-  err  = clSetKernelArg(ckReorder, 1, sizeof(cl_mem), &d_outKeys);
+  err = clSetKernelArg(ckReorder, 3, sizeof(uint), &pass);
   assert(err == CL_SUCCESS);
 
-  err = clSetKernelArg(ckReorder, 3, sizeof(uint), &pass);
+  err  = clSetKernelArg(ckReorder, 6,
+			sizeof(uint)* _LOCALSIZE ,
+			NULL); // mem cache
   assert(err == CL_SUCCESS);
 
-  err  = clSetKernelArg(ckReorder, 4, sizeof(cl_mem), &d_inPermut);
+  assert( nkeys_rounded%_PADSIZE == 0);
+
+  err = clSetKernelArg(ckReorder, 7, sizeof(uint), &nkeys_rounded);
   assert(err == CL_SUCCESS);
 
-  err  = clSetKernelArg(ckReorder, 5, sizeof(cl_mem), &d_outPermut);
+  err = clSetKernelArg(ckReorder, 8, sizeof(uint), &npass);
   assert(err == CL_SUCCESS);
 
-  err  = clSetKernelArg(ckReorder, 6,
-			sizeof(uint)* _RADIX * _ITEMS ,
-			NULL); // mem cache
+
+  assert(_RADIX == pow(2,_BITS));
+
+  cl_event eve;
+
+  cl_mem d_keysdest[2],d_permsrc[2],d_permdest[2];
+  int ncalls=OutputLists(d_keysdest,d_permsrc,d_permdest);
+
+  for(int call=0;call<ncalls;call++){
+
+    err  = clSetKernelArg(ckReorder, 1, sizeof(cl_mem), &d_keysdest[call]);
+    assert(err == CL_SUCCESS);
+
+    err  = clSetKernelArg(ckReorder, 4, sizeof(cl_mem), &d_permsrc[call]);
+    assert(err == CL_SUCCESS);
+
+    err  = clSetKernelArg(ckReorder, 5, sizeof(cl_mem), &d_permdest[call]);
+    assert(err == CL_SUCCESS);
+
+    err = clEnqueueNDRangeKernel(CommandQueue,
+				 ckReorder,
+				 1, NULL,
+				 &nbitems,
+				 &nblocitems,
+				 0, NULL, &eve);
+  
+    assert(err== CL_SUCCESS);
+    clFinish(CommandQueue);  
+
+    cl_ulong debut,fin;
+
+    err=clGetEventProfilingInfo (eve,
+				 CL_PROFILING_COMMAND_QUEUED,
+				 sizeof(cl_ulong),
+				 (void*) &debut,
+				 NULL);
+    assert(err== CL_SUCCESS);
+
+    err=clGetEventProfilingInfo (eve,
+				 CL_PROFILING_COMMAND_END,
+				 sizeof(cl_ulong),
+				 (void*) &fin,
+				 NULL);
+    assert(err== CL_SUCCESS);
+
+    reorder_time += (float) (fin-debut)/1e9;
+    Trace(eve,"reorder");
+  }
+
+  // swap the old and new vectors of keys and permutations
+  SwapLists();
+
+}
+
+// destinations of the reordered keys and permutation
+// return the number of calls of the reordering kernel:
+// with a single scratch list, the permutation is first reordered in
+// the scratch list and then the keys in the old permutation list
+int CLRadixSort::OutputLists(cl_mem* d_keysdest,cl_mem* d_permsrc,cl_mem* d_permdest){
+
+#ifdef SINGLESCRATCH
+  d_keysdest[0]=NULL;
+  d_permsrc[0]=d_inPermut;
+  d_permdest[0]=d_outKeys;
+  d_keysdest[1]=d_inPermut;
+  d_permsrc[1]=NULL;
+  d_permdest[1]=NULL;
+  return 2;
+#else
+  d_keysdest[0]=d_outKeys;
+  d_permsrc[0]=d_inPermut;
+  d_permdest[0]=d_outPermut;
+  return 1;
+#endif
+
+}
+
+// exchange the input and output lists after a reordering
+void CLRadixSort::SwapLists(void){
+
+  cl_mem d_temp;
+
+#ifdef SINGLESCRATCH
+  // the new keys are in the old permutation list, the new permutation
+  // in the scratch list and the old keys list becomes the scratch list
+  d_temp=d_inKeys;
+  d_inKeys=d_inPermut;
+  d_inPermut=d_outKeys;
+  d_outKeys=d_temp;
+#else
+  // swap the old and new vectors of keys
+  d_temp=d_inKeys;
+  d_inKeys=d_outKeys;
+  d_outKeys=d_temp;
+
+  // swap the old and new permutations
+  d_temp=d_inPermut;
+  d_inPermut=d_outPermut;
+  d_outPermut=d_temp;
+#endif
+
+}
+
+// radix selection of the k-th smallest key
+// the histogram of the candidates is computed digit after digit,
+// starting from the most significant one. Only the candidates
+// in the bucket of the k-th key are kept for the next digit.
+uint CLRadixSort::Select(uint k){
+
+  assert(k < nkeys);
+
+  cl_int err;
+
+  // the candidates are compacted alternatively
+  // in d_outKeys and d_selKeys
+  AcquireScratch();
+  if (d_selKeys == NULL) {
+    d_selKeys=CLBufferPool::Acquire(Context,sizeof(keytype)* _N);
+  }
+
+  cl_mem d_cand=d_inKeys;  // list of candidates
+  uint ncand=nkeys;  // number of candidates
+  uint ncand_rounded=nkeys_rounded; // with the padding
+  uint prefix=0;   // digits of the k-th key already found
+  nsmaller=0;
+
+  keytype pad[_PADSIZE];
+  for(int ii=0;ii<_PADSIZE;ii++){
+    pad[ii]=_KEYMASK;
+  }
+
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=_GROUPS*_ITEMS;
+
+  cl_event eve;
+  cl_ulong debut,fin;
+
+  for(int pass=_PASS-1;pass>=0;pass--){
+
+    // few candidates: finish the selection on the host
+    if (ncand <= _GROUPS * _ITEMS) {
+      vector<keytype> cand(ncand);
+      err = clEnqueueReadBuffer(CommandQueue,
+				d_cand,
+				CL_TRUE, 0,
+				sizeof(keytype) * ncand,
+				&cand[0],
+				0, NULL, NULL);
+      assert(err == CL_SUCCESS);
+      nth_element(cand.begin(),cand.begin()+k,cand.end());
+      uint kth=cand[k];
+      for(uint i=0;i<ncand;i++){
+	if (cand[i] < kth) nsmaller++;
+      }
+      ReleaseScratch();
+      return kth;
+    }
+
+    // histogram of the digit of the pass for the candidates
+    err  = clSetKernelArg(ckHistogram, 0, sizeof(cl_mem), &d_cand);
+    assert(err == CL_SUCCESS);
+
+    err = clSetKernelArg(ckHistogram, 2, sizeof(uint), &pass);
+    assert(err == CL_SUCCESS);
+
+    err = clSetKernelArg(ckHistogram, 4, sizeof(uint), &ncand_rounded);
+    assert(err == CL_SUCCESS);
+
+    err = clEnqueueNDRangeKernel(CommandQueue,
+				 ckHistogram,
+				 1, NULL,
+				 &nbitems,
+				 &nblocitems,
+				 0, NULL, &eve);
+    assert(err== CL_SUCCESS);
+    clFinish(CommandQueue);
+
+    err=clGetEventProfilingInfo (eve,
+				 CL_PROFILING_COMMAND_QUEUED,
+				 sizeof(cl_ulong),
+				 (void*) &debut,
+				 NULL);
+    assert(err== CL_SUCCESS);
+
+    err=clGetEventProfilingInfo (eve,
+				 CL_PROFILING_COMMAND_END,
+				 sizeof(cl_ulong),
+				 (void*) &fin,
+				 NULL);
+    assert(err== CL_SUCCESS);
+
+    select_time += (float) (fin-debut)/1e9;
+    Trace(eve,"histogram");
+
+    ScanHistogram();
+
+    // the first value of the scanned histogram of a radix
+    // is the number of candidates with a smaller digit
+    uint start[_RADIX+1];
+    for(uint ir=0;ir<_RADIX;ir++){
+      err = clEnqueueReadBuffer(CommandQueue,
+				d_Histograms,
+				CL_FALSE, sizeof(uint) * ir * (_HISTOSIZE / _RADIX),
+				sizeof(uint),
+				&start[ir],
+				0, NULL, NULL);
+      assert(err == CL_SUCCESS);
+    }
+    clFinish(CommandQueue);
+    start[_RADIX]=ncand_rounded;
+
+    // remove the padding keys from their bucket
+    uint padradix=(pad[0] >> (pass * _BITS)) & (_RADIX-1);
+    for(uint ir=padradix+1;ir<=_RADIX;ir++){
+      start[ir] -= ncand_rounded-ncand;
+    }
+
+    // bucket of the k-th key
+    uint radix=0;
+    while(start[radix+1] <= k) radix++;
+    k -= start[radix];
+    nsmaller += start[radix];
+    prefix |= radix << (pass * _BITS);
+    uint nnew=start[radix+1]-start[radix];
+
+    if (VERBOSE){
+      cout << "Select pass "<<pass<<": "<<nnew<<" candidates"<<endl;
+    }
+
+    // compaction of the candidates (useless if all the
+    // candidates are in the same bucket, or for the last digit)
+    if (pass > 0 && nnew < ncand) {
+
+      cl_mem d_next= (d_cand == d_outKeys) ? d_selKeys : d_outKeys;
+
+      uint zero[2]={0,0};
+      err = clEnqueueWriteBuffer(CommandQueue,
+				 d_selCount,
+				 CL_TRUE, 0,
+				 sizeof(uint) * 2,
+				 zero,
+				 0, NULL, NULL);
+      assert(err == CL_SUCCESS);
+
+      err  = clSetKernelArg(ckSelectRadix, 0, sizeof(cl_mem), &d_cand);
+      assert(err == CL_SUCCESS);
+
+      err  = clSetKernelArg(ckSelectRadix, 1, sizeof(cl_mem), &d_next);
+      assert(err == CL_SUCCESS);
+
+      err = clSetKernelArg(ckSelectRadix, 2, sizeof(uint), &pass);
+      assert(err == CL_SUCCESS);
+
+      err = clSetKernelArg(ckSelectRadix, 3, sizeof(uint), &radix);
+      assert(err == CL_SUCCESS);
+
+      err = clSetKernelArg(ckSelectRadix, 4, sizeof(uint), &ncand);
+      assert(err == CL_SUCCESS);
+
+      err  = clSetKernelArg(ckSelectRadix, 5, sizeof(cl_mem), &d_selCount);
+      assert(err == CL_SUCCESS);
+
+      err = clEnqueueNDRangeKernel(CommandQueue,
+				   ckSelectRadix,
+				   1, NULL,
+				   &nbitems,
+				   &nblocitems,
+				   0, NULL, &eve);
+      assert(err== CL_SUCCESS);
+      clFinish(CommandQueue);
+
+      err=clGetEventProfilingInfo (eve,
+				   CL_PROFILING_COMMAND_QUEUED,
+				   sizeof(cl_ulong),
+				   (void*) &debut,
+				   NULL);
+      assert(err== CL_SUCCESS);
+
+      err=clGetEventProfilingInfo (eve,
+				   CL_PROFILING_COMMAND_END,
+				   sizeof(cl_ulong),
+				   (void*) &fin,
+				   NULL);
+      assert(err== CL_SUCCESS);
+
+      select_time += (float) (fin-debut)/1e9;
+      Trace(eve,"selectradix");
+
+      // pad the new list of candidates
+      ncand=nnew;
+      int reste=ncand % _PADSIZE;
+      ncand_rounded=ncand;
+      if (reste != 0) {
+	ncand_rounded=ncand-reste+_PADSIZE;
+	err = clEnqueueWriteBuffer(CommandQueue,
+				   d_next,
+				   CL_TRUE, sizeof(keytype)*ncand,
+				   sizeof(keytype) *(_PADSIZE - reste) ,
+				   pad,
+				   0, NULL, NULL);
+	assert(err == CL_SUCCESS);
+      }
+      d_cand=d_next;
+    }
+  }
+
+  ReleaseScratch();
+
+  return prefix;
+
+}
+
+// the k smallest keys
+void CLRadixSort::TopK(uint k,cl_mem d_topKeys,cl_mem d_topPermut){
+
+  assert(k > 0 && k <= nkeys);
+#ifdef PERMUT
+  assert(d_topPermut != NULL);
+#endif
+
+  cl_int err;
+
+  // the largest of the k smallest keys and the number
+  // of equal keys that have to be kept
+  uint kth=Select(k-1);
+  uint nequal=k-nsmaller;
+
+  uint zero[2]={0,0};
+  err = clEnqueueWriteBuffer(CommandQueue,
+			     d_selCount,
+			     CL_TRUE, 0,
+			     sizeof(uint) * 2,
+			     zero,
+			     0, NULL, NULL);
   assert(err == CL_SUCCESS);
 
-  assert( nkeys_rounded%(_GROUPS * _ITEMS) == 0);
+  err  = clSetKernelArg(ckTopK, 0, sizeof(cl_mem), &d_inKeys);
+  assert(err == CL_SUCCESS);
 
-  err = clSetKernelArg(ckReorder, 7, sizeof(uint), &nkeys_rounded);
+  err  = clSetKernelArg(ckTopK, 1, sizeof(cl_mem), &d_topKeys);
   assert(err == CL_SUCCESS);
 
+  err  = clSetKernelArg(ckTopK, 2, sizeof(cl_mem), &d_inPermut);
+  assert(err == CL_SUCCESS);
 
-  assert(_RADIX == pow(2,_BITS));
+  err  = clSetKernelArg(ckTopK, 3, sizeof(cl_mem), &d_topPermut);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckTopK, 4, sizeof(uint), &kth);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckTopK, 5, sizeof(uint), &nsmaller);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckTopK, 6, sizeof(uint), &nequal);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckTopK, 7, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckTopK, 8, sizeof(cl_mem), &d_selCount);
+  assert(err == CL_SUCCESS);
+
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=_GROUPS*_ITEMS;
 
   cl_event eve;
 
   err = clEnqueueNDRangeKernel(CommandQueue,
-			       ckReorder,
+			       ckTopK,
 			       1, NULL,
 			       &nbitems,
 			       &nblocitems,
 			       0, NULL, &eve);
-  
   assert(err== CL_SUCCESS);
-  clFinish(CommandQueue);  
+  clFinish(CommandQueue);
 
   cl_ulong debut,fin;
 
   err=clGetEventProfilingInfo (eve,
-			   CL_PROFILING_COMMAND_QUEUED,
-			   sizeof(cl_ulong),
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
 			       (void*) &debut,
-			   NULL);
+			       NULL);
   assert(err== CL_SUCCESS);
 
   err=clGetEventProfilingInfo (eve,
-			   CL_PROFILING_COMMAND_END,
-			   sizeof(cl_ulong),
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
 			       (void*) &fin,
-			   NULL);
+			       NULL);
   assert(err== CL_SUCCESS);
 
-  reorder_time += (float) (fin-debut)/1e9;
+  select_time += (float) (fin-debut)/1e9;
+  Trace(eve,"topk");
 
+}
 
+// activate the computation of the cells offsets
+void CLRadixSort::SetCells(uint nc){
 
-  // swap the old and new vectors of keys
-  cl_mem d_temp;
-  d_temp=d_inKeys;
-  d_inKeys=d_outKeys;
-  d_outKeys=d_temp;
+  ReleaseBuffer(d_CellOffsets);
+  d_CellOffsets=NULL;
 
-  // swap the old and new permutations
-  d_temp=d_inPermut;
-  d_inPermut=d_outPermut;
-  d_outPermut=d_temp;
+  ncells=nc;
+
+  if (ncells > 0) {
+    d_CellOffsets=CreateBuffer(sizeof(uint)* (ncells+1));
+  }
 
 }
 
-//  van der corput sequence
-float corput(int n,int k1,int k2){
-  float corput=0;
-  float s=1;
-  while(n>0){
-    s/=k1;
-    corput+=(k2*n%k1)%k1*s;
-    n/=k1;
-  }
-  return corput;
+// bits of the 16 low bits of v at the even positions
+// (the same as in the kernels)
+static uint spreadbits(uint v){
+  v &= 0xFFFF;
+  v = (v | (v << 8)) & 0x00FF00FF;
+  v = (v | (v << 4)) & 0x0F0F0F0F;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
 }
 
+// cells keys of particles and histogram of the first pass
+bool CLRadixSort::CellKeys(cl_mem d_x,cl_mem d_y,uint np,
+			   float x0,float y0,float dx,float dy,
+			   uint nx,uint ny,bool morton,bool offsets){
+
+  assert(nx > 0 && ny > 0);
+
+  // the largest key is the key of the last cell
+  unsigned long long maxkey;
+  if (morton) {
+    if (nx > 65536 || ny > 65536) {
+      cerr << "Morton grid larger than 65536*65536: "<<nx<<"*"<<ny<<endl;
+      return false;
+    }
+    maxkey=(spreadbits(nx-1) << 1) | spreadbits(ny-1);
+  }
+  else {
+    maxkey=(unsigned long long) nx*ny-1;
+  }
+  if (maxkey > _KEYMASK) {
+    cerr << "cells keys larger than "<<_TOTALBITS<<" bits"<<endl;
+    return false;
+  }
+  if (offsets && maxkey+1 != ncells) SetCells(maxkey+1);
+
+  Resize(np);
+
+  // the histogram is kept in the scratch lists until the sort
+  AcquireScratch();
+
+  cl_int err;
+
+  float invdx=1/dx;
+  float invdy=1/dy;
+  int mort=morton;
+
+  err  = clSetKernelArg(ckCellKeys, 0, sizeof(cl_mem), &d_x);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckCellKeys, 1, sizeof(cl_mem), &d_y);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckCellKeys, 2, sizeof(cl_mem), &d_inKeys);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckCellKeys, 3, sizeof(cl_mem), &d_inPermut);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckCellKeys, 4, sizeof(cl_mem), &d_Histograms);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckCellKeys, 5, sizeof(uint)*_LOCALSIZE, NULL);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 6, sizeof(float), &x0);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 7, sizeof(float), &y0);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 8, sizeof(float), &invdx);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 9, sizeof(float), &invdy);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 10, sizeof(uint), &nx);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 11, sizeof(uint), &ny);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 12, sizeof(int), &mort);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 13, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCellKeys, 14, sizeof(uint), &nkeys_rounded);
+  assert(err == CL_SUCCESS);
+
+  // the same distribution as the histograms
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=_GROUPS*_ITEMS;
+
+  cl_event eve;
 
+  err = clEnqueueNDRangeKernel(CommandQueue,
+			       ckCellKeys,
+			       1, NULL,
+			       &nbitems,
+			       &nblocitems,
+			       0, NULL, &eve);
+  assert(err== CL_SUCCESS);
+  clFinish(CommandQueue);
+
+  cl_ulong debut,fin;
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
+			       (void*) &debut,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
+			       (void*) &fin,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  histo_time += (float) (fin-debut)/1e9;
+  Trace(eve,"cellkeys");
+
+  histo0=true;
+
+  return true;
+
+}
+
+// cells offsets of the sorted list
+// (the transposition, if any, has been undone at the end of the sort)
+void CLRadixSort::CellOffsets(void){
+
+  assert(ncells > 0);
+
+  cl_int err;
+
+  err  = clSetKernelArg(ckCellOffsets, 0, sizeof(cl_mem), &d_inKeys);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckCellOffsets, 1, sizeof(cl_mem), &d_CellOffsets);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckCellOffsets, 2, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckCellOffsets, 3, sizeof(uint), &ncells);
+  assert(err == CL_SUCCESS);
+
+  // one work item per key, plus one for the end of the list
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=(nkeys+1+_ITEMS-1)/_ITEMS*_ITEMS;
+
+  cl_event eve;
+
+  err = clEnqueueNDRangeKernel(CommandQueue,
+			       ckCellOffsets,
+			       1, NULL,
+			       &nbitems,
+			       &nblocitems,
+			       0, NULL, &eve);
+  assert(err== CL_SUCCESS);
+  clFinish(CommandQueue);
+
+  cl_ulong debut,fin;
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
+			       (void*) &debut,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
+			       (void*) &fin,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  cell_time += (float) (fin-debut)/1e9;
+  Trace(eve,"celloffsets");
+
+}
+
+// largest key of the list (device reduction)
+uint CLRadixSort::MaxKey(void){
+
+  cl_int err;
+
+  uint zero=0;
+  err = clEnqueueWriteBuffer(CommandQueue,
+			     d_selCount,
+			     CL_TRUE, 0,
+			     sizeof(uint),
+			     &zero,
+			     0, NULL, NULL);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckMaxKey, 0, sizeof(cl_mem), &d_inKeys);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckMaxKey, 1, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckMaxKey, 2, sizeof(cl_mem), &d_selCount);
+  assert(err == CL_SUCCESS);
+
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=_GROUPS*_ITEMS;
+
+  cl_event eve;
+
+  err = clEnqueueNDRangeKernel(CommandQueue,
+			       ckMaxKey,
+			       1, NULL,
+			       &nbitems,
+			       &nblocitems,
+			       0, NULL, &eve);
+  assert(err== CL_SUCCESS);
+  clFinish(CommandQueue);
+
+  cl_ulong debut,fin;
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
+			       (void*) &debut,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
+			       (void*) &fin,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  maxkey_time += (float) (fin-debut)/1e9;
+  Trace(eve,"maxkey");
+
+  uint maxkey;
+  err = clEnqueueReadBuffer(CommandQueue,
+			    d_selCount,
+			    CL_TRUE, 0,
+			    sizeof(uint),
+			    &maxkey,
+			    0, NULL, NULL);
+  assert(err == CL_SUCCESS);
+
+  return maxkey;
+
+}
+
+#ifdef PERMUT
+// sort a list of records by a key field
+bool CLRadixSort::SortRecords(cl_mem d_inRecords,cl_mem d_outRecords,
+			      uint nrec,uint stride,
+			      uint keyoffset,uint keywidth,
+			      bool descending){
+
+  assert(keywidth == 1 || keywidth == 2 || keywidth == 4);
+  assert(keyoffset+keywidth <= stride);
+
+  cl_int err;
+
+  Resize(nrec);
+
+  // extract the keys and initialize the permutation
+  // (the descending keys are complemented to the largest key
+  // of keywidth bytes that fits in _TOTALBITS bits)
+  uint desc=descending;
+  uint top=keywidth == 4 ? 0xFFFFFFFFu : (1u << 8*keywidth)-1;
+  top=min(top,(uint) _KEYMASK);
+
+  uint zero=0;
+  err = clEnqueueWriteBuffer(CommandQueue,
+			     d_selCount,
+			     CL_TRUE, 0,
+			     sizeof(uint),
+			     &zero,
+			     0, NULL, NULL);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckRecordKeys, 0, sizeof(cl_mem), &d_inRecords);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckRecordKeys, 1, sizeof(cl_mem), &d_inKeys);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckRecordKeys, 2, sizeof(cl_mem), &d_inPermut);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckRecordKeys, 3, sizeof(uint), &stride);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckRecordKeys, 4, sizeof(uint), &keyoffset);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckRecordKeys, 5, sizeof(uint), &keywidth);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckRecordKeys, 6, sizeof(uint), &desc);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckRecordKeys, 7, sizeof(uint), &top);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckRecordKeys, 8, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckRecordKeys, 9, sizeof(uint), &nkeys_rounded);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckRecordKeys, 10, sizeof(cl_mem), &d_selCount);
+  assert(err == CL_SUCCESS);
+
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=nkeys_rounded;
+
+  cl_event eve;
+  cl_ulong debut,fin;
+
+  err = clEnqueueNDRangeKernel(CommandQueue,
+			       ckRecordKeys,
+			       1, NULL,
+			       &nbitems,
+			       &nblocitems,
+			       0, NULL, &eve);
+  assert(err== CL_SUCCESS);
+  clFinish(CommandQueue);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
+			       (void*) &debut,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
+			       (void*) &fin,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  record_time += (float) (fin-debut)/1e9;
+  Trace(eve,"recordkeys");
+
+  // the keys have to fit in _TOTALBITS bits
+  uint maxkey;
+  err = clEnqueueReadBuffer(CommandQueue,
+			    d_selCount,
+			    CL_TRUE, 0,
+			    sizeof(uint),
+			    &maxkey,
+			    0, NULL, NULL);
+  assert(err == CL_SUCCESS);
+
+  if (maxkey > _KEYMASK) {
+    cerr << "records keys larger than "<<_TOTALBITS<<" bits"<<endl;
+    return false;
+  }
+
+  // only the passes needed by the largest key
+  Sort(descending ? top : maxkey);
+
+  // move the records in the sorted order
+  err  = clSetKernelArg(ckReorderRecords, 0, sizeof(cl_mem), &d_inRecords);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckReorderRecords, 1, sizeof(cl_mem), &d_outRecords);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckReorderRecords, 2, sizeof(cl_mem), &d_inPermut);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckReorderRecords, 3, sizeof(uint), &stride);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckReorderRecords, 4, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+
+  nbitems=(nkeys+_ITEMS-1)/_ITEMS*_ITEMS;
+
+  err = clEnqueueNDRangeKernel(CommandQueue,
+			       ckReorderRecords,
+			       1, NULL,
+			       &nbitems,
+			       &nblocitems,
+			       0, NULL, &eve);
+  assert(err== CL_SUCCESS);
+  clFinish(CommandQueue);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
+			       (void*) &debut,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
+			       (void*) &fin,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  record_time += (float) (fin-debut)/1e9;
+  Trace(eve,"reorderrecords");
+
+  return true;
+
+}
+
+// lexicographic sort of several columns of keys
+void CLRadixSort::SortColumns(int ncols,const cl_mem* d_cols,
+			      const uint* colbits,uint nrec){
+
+  assert(ncols > 0);
+
+  cl_int err;
+
+  Resize(nrec);
+
+  // cut the columns in pieces of keys of at most _TOTALBITS bits,
+  // from the least significant bit of the last column
+  // (the piece p is made of the bits pshift[p]..pshift[p]+pbits[p]-1
+  // of the column pcol[p] and belongs to the key pkey[p])
+  vector<int> pcol,pshift,pbits,pkey;
+  int nk=0;
+  int room=0;
+  for(int c=ncols-1;c>=0;c--){
+    assert(colbits[c] > 0 && colbits[c] <= 32);
+    int lo=0;
+    while(lo < (int) colbits[c]){
+      if (room == 0) {
+	nk++;
+	room=_TOTALBITS;
+      }
+      int b=min(room,(int) colbits[c]-lo);
+      pcol.push_back(c);
+      pshift.push_back(lo);
+      pbits.push_back(b);
+      pkey.push_back(nk-1);
+      lo+=b;
+      room-=b;
+    }
+  }
+  int npieces=pcol.size();
+
+  if (VERBOSE) {
+    cout << "sort of "<<ncols<<" columns in "<<nk<<" keys"<<endl;
+  }
+
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=nkeys_rounded;
+
+  cl_event eve;
+  cl_ulong debut,fin;
+
+  // sort the keys from the least significant one: the sort is
+  // stable, so that each sort keeps the order of the previous ones
+  int first=0;
+  for(int k=0;k<nk;k++){
+    int last=first;
+    while(last < npieces && pkey[last] == k) last++;
+
+    // pack the pieces of the key, the most significant first
+    int keybits=0;
+    for(int p=last-1;p>=first;p--){
+      int start= (p == last-1);
+      int init= (k == 0);
+      err  = clSetKernelArg(ckPackKeys, 0, sizeof(cl_mem), &d_cols[pcol[p]]);
+      assert(err == CL_SUCCESS);
+      err  = clSetKernelArg(ckPackKeys, 1, sizeof(cl_mem), &d_inKeys);
+      assert(err == CL_SUCCESS);
+      err  = clSetKernelArg(ckPackKeys, 2, sizeof(cl_mem), &d_inPermut);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(ckPackKeys, 3, sizeof(int), &pshift[p]);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(ckPackKeys, 4, sizeof(int), &pbits[p]);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(ckPackKeys, 5, sizeof(int), &start);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(ckPackKeys, 6, sizeof(int), &init);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(ckPackKeys, 7, sizeof(uint), &nkeys);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(ckPackKeys, 8, sizeof(uint), &nkeys_rounded);
+      assert(err == CL_SUCCESS);
+
+      err = clEnqueueNDRangeKernel(CommandQueue,
+				   ckPackKeys,
+				   1, NULL,
+				   &nbitems,
+				   &nblocitems,
+				   0, NULL, &eve);
+      assert(err== CL_SUCCESS);
+      clFinish(CommandQueue);
+
+      err=clGetEventProfilingInfo (eve,
+				   CL_PROFILING_COMMAND_QUEUED,
+				   sizeof(cl_ulong),
+				   (void*) &debut,
+				   NULL);
+      assert(err== CL_SUCCESS);
+
+      err=clGetEventProfilingInfo (eve,
+				   CL_PROFILING_COMMAND_END,
+				   sizeof(cl_ulong),
+				   (void*) &fin,
+				   NULL);
+      assert(err== CL_SUCCESS);
+
+      pack_time += (float) (fin-debut)/1e9;
+      Trace(eve,"packkeys");
+
+      keybits+=pbits[p];
+    }
+
+    // only the passes of the bits of the key
+    Sort(0xFFFFFFFFu >> (32-keybits));
+
+    first=last;
+  }
+
+}
+#endif
+
+// merge with a sorted batch of keys
+void CLRadixSort::Merge(cl_mem d_newKeys,cl_mem d_newPermut,uint nnew){
+
+#define _MERGECHUNK 16 // number of merged keys per work item
+
+  assert(nkeys+nnew <= _N);
+
+  cl_int err;
+
+  uint ntot=nkeys+nnew;
+  uint chunk=_MERGECHUNK;
+
+  AcquireScratch();
+
+  err  = clSetKernelArg(ckMergePath, 0, sizeof(cl_mem), &d_inKeys);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckMergePath, 2, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckMergePath, 3, sizeof(cl_mem), &d_newKeys);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckMergePath, 4, sizeof(cl_mem), &d_newPermut);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckMergePath, 5, sizeof(uint), &nnew);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckMergePath, 8, sizeof(uint), &nkeys);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckMergePath, 9, sizeof(uint), &chunk);
+  assert(err == CL_SUCCESS);
+
+  // balanced partition: each work item produces chunk keys
+  size_t nblocitems=_ITEMS;
+  size_t nbitems=(ntot+chunk-1)/chunk;
+  nbitems=(nbitems+_ITEMS-1)/_ITEMS*_ITEMS;
+
+  cl_event eve;
+
+  cl_mem d_keysdest[2],d_permsrc[2],d_permdest[2];
+  int ncalls=OutputLists(d_keysdest,d_permsrc,d_permdest);
+
+  for(int call=0;call<ncalls;call++){
+
+    err  = clSetKernelArg(ckMergePath, 1, sizeof(cl_mem), &d_permsrc[call]);
+    assert(err == CL_SUCCESS);
+
+    err  = clSetKernelArg(ckMergePath, 6, sizeof(cl_mem), &d_keysdest[call]);
+    assert(err == CL_SUCCESS);
+
+    err  = clSetKernelArg(ckMergePath, 7, sizeof(cl_mem), &d_permdest[call]);
+    assert(err == CL_SUCCESS);
+
+    err = clEnqueueNDRangeKernel(CommandQueue,
+				 ckMergePath,
+				 1, NULL,
+				 &nbitems,
+				 &nblocitems,
+				 0, NULL, &eve);
+    assert(err== CL_SUCCESS);
+    clFinish(CommandQueue);
+
+    cl_ulong debut,fin;
+
+    err=clGetEventProfilingInfo (eve,
+				 CL_PROFILING_COMMAND_QUEUED,
+				 sizeof(cl_ulong),
+				 (void*) &debut,
+				 NULL);
+    assert(err== CL_SUCCESS);
+
+    err=clGetEventProfilingInfo (eve,
+				 CL_PROFILING_COMMAND_END,
+				 sizeof(cl_ulong),
+				 (void*) &fin,
+				 NULL);
+    assert(err== CL_SUCCESS);
+
+    merge_time += (float) (fin-debut)/1e9;
+    Trace(eve,"mergepath");
+  }
+
+  // swap the old and new vectors of keys and permutations
+  SwapLists();
+
+  ReleaseScratch();
+
+  // new size and padding
+  Resize(ntot);
+
+}
+
+// take the scratch lists in the pool of the context
+void CLRadixSort::AcquireScratch(void){
+
+  if (scratch) return;
+
+  // the lists exchanged with those of the object have their size
+  d_outKeys=CLBufferPool::Acquire(Context,sizeof(keytype)* _N,true);
+#if defined(PERMUT) && !defined(SINGLESCRATCH)
+  d_outPermut=CLBufferPool::Acquire(Context,sizeof(uint)* _N,true);
+#endif
+  d_Histograms=CLBufferPool::Acquire(Context,sizeof(uint)* _HISTOSIZE);
+  d_globsum=CLBufferPool::Acquire(Context,sizeof(uint)* _HISTOSPLIT);
+  // the second scan is made by one work group
+  d_temp=CLBufferPool::Acquire(Context,sizeof(uint));
+
+  // the lists of the pool, before the exchanges of the sort
+  pool_outKeys=d_outKeys;
+  pool_outPermut=d_outPermut;
+
+  scratch=true;
+
+  cl_int err;
+
+  // we set here the arguments of the OpenCL kernels that
+  // do not change during the sort
+  // the changing arguments are modified elsewhere in the class
+  err = clSetKernelArg(ckHistogram, 1, sizeof(cl_mem), &d_Histograms);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckHistogram, 3, sizeof(uint)*_LOCALSIZE, NULL);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckPasteHistogram, 0, sizeof(cl_mem), &d_Histograms);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckPasteHistogram, 1, sizeof(cl_mem), &d_globsum);
+  assert(err == CL_SUCCESS);
+
+  err = clSetKernelArg(ckReorder, 2, sizeof(cl_mem), &d_Histograms);
+  assert(err == CL_SUCCESS);
+
+  err  = clSetKernelArg(ckReorder, 6,
+			sizeof(uint)* _LOCALSIZE ,
+			NULL); // local cache memory
+  assert(err == CL_SUCCESS);
+
+}
+
+// give the scratch lists back to the pool
+void CLRadixSort::ReleaseScratch(void){
+
+  if (!scratch) return;
+
+  // after the exchanges of the lists, the data may be in a list of the
+  // pool: the pool takes the free list instead (of the same size)
+  CLBufferPool::Exchange(Context,pool_outKeys,d_outKeys);
+  CLBufferPool::Exchange(Context,pool_outPermut,d_outPermut);
+
+  CLBufferPool::Release(Context,d_outKeys);
+  CLBufferPool::Release(Context,d_outPermut);
+  CLBufferPool::Release(Context,d_Histograms);
+  CLBufferPool::Release(Context,d_globsum);
+  CLBufferPool::Release(Context,d_temp);
+  CLBufferPool::Release(Context,d_selKeys);
+
+  d_outKeys=NULL;
+  d_outPermut=NULL;
+  d_Histograms=NULL;
+  d_globsum=NULL;
+  d_temp=NULL;
+  d_selKeys=NULL;
+
+  scratch=false;
+
+}
+
+// allocate a list on the device and count the used memory
+cl_mem CLRadixSort::CreateBuffer(size_t size){
+
+  cl_int err;
+
+  cl_mem d_buf = clCreateBuffer(Context,
+				CL_MEM_READ_WRITE,
+				size,
+				NULL,
+				&err);
+  assert(err == CL_SUCCESS);
+
+  devmem += size;
+  devmem_peak=max(devmem_peak,devmem);
+
+  return d_buf;
+
+}
+
+// free a list on the device (if allocated)
+void CLRadixSort::ReleaseBuffer(cl_mem d_buf){
+
+  if (d_buf == NULL) return;
+
+  size_t size;
+  cl_int err;
+
+  err=clGetMemObjectInfo(d_buf,CL_MEM_SIZE,sizeof(size_t),&size,NULL);
+  assert(err == CL_SUCCESS);
+  devmem -= size;
+
+  clReleaseMemObject(d_buf);
+
+}
+
+// stream of batches: one sorter per slot
+CLSortStream::CLSortStream(cl_context GPUContext,
+			   cl_device_id dev,
+			   int nslots) :
+  nbatches(0),
+  ndone(0),
+  Context(GPUContext)
+{
+
+  // at least one batch sorted while the next one is uploaded
+  assert(nslots >= 2);
+
+  cl_int err;
+
+  // the sorts need the profiling of the kernels
+  ComputeQueue = clCreateCommandQueue(Context,
+				      dev,
+				      CL_QUEUE_PROFILING_ENABLE,
+				      &err);
+  assert(err == CL_SUCCESS);
+
+  TransferQueue = clCreateCommandQueue(Context,
+				       dev,
+				       0,
+				       &err);
+  assert(err == CL_SUCCESS);
+
+  slots.resize(nslots);
+  for(int i=0;i<nslots;i++){
+    slots[i].rs=new CLRadixSort(Context,dev,ComputeQueue);
+    slots[i].state=FREE;
+  }
+
+#ifdef PERMUT
+  h_identity.resize(_N);
+  for(uint i=0;i<_N;i++){
+    h_identity[i]=i;
+  }
+#endif
+
+}
+
+CLSortStream::~CLSortStream()
+{
+  Flush();
+  for(size_t i=0;i<slots.size();i++){
+    delete slots[i].rs;
+  }
+  clReleaseCommandQueue(TransferQueue);
+  clReleaseCommandQueue(ComputeQueue);
+};
+
+// new batch
+int CLSortStream::Push(const keytype* keys,uint n,keytype* sorted,uint* permut){
+
+  assert(n > 0 && n <= _N);
+
+  int batch=nbatches;
+  Slot& slot=slots[batch % slots.size()];
+  Slot& prev=slots[(batch+slots.size()-1) % slots.size()];
+
+  // the slot is free when the download of its last batch is finished
+  WaitSlot(slot);
+
+  // upload the batch (non blocking)
+  slot.rs->Resize(n);
+  slot.n=n;
+  slot.sorted=sorted;
+  slot.permut=permut;
+
+#ifdef PERMUT
+  slot.upload=slot.rs->SendKeys(0,n,keys,&h_identity[0],TransferQueue);
+#else
+  slot.upload=slot.rs->SendKeys(0,n,keys,NULL,TransferQueue);
+#endif
+  slot.state=UPLOADED;
+
+  // meanwhile, sort the previous batch
+  if (prev.state == UPLOADED) SortSlot(prev);
+
+  nbatches++;
+
+  return batch;
+
+}
+
+// sort the remaining batches and wait for their download
+void CLSortStream::Flush(void){
+
+  for(int b=ndone;b<nbatches;b++){
+    Slot& slot=slots[b % slots.size()];
+    if (slot.state == UPLOADED) SortSlot(slot);
+    WaitSlot(slot);
+  }
+
+}
+
+// sort the batch of a slot and start its download (non blocking)
+void CLSortStream::SortSlot(Slot& slot){
+
+  assert(slot.state == UPLOADED);
+
+  cl_int err;
+
+  // the upload is on the other queue
+  err = clWaitForEvents(1,&slot.upload);
+  assert(err == CL_SUCCESS);
+  clReleaseEvent(slot.upload);
+
+  slot.rs->Sort();
+
+  slot.download=slot.rs->RecupKeys(0,slot.n,slot.sorted,slot.permut,
+				   TransferQueue);
+  slot.state=DOWNLOADING;
+
+}
+
+// wait the end of the download of a slot
+void CLSortStream::WaitSlot(Slot& slot){
+
+  if (slot.state != DOWNLOADING) return;
+
+  cl_int err;
+
+  // the transfer queue is in order: the download
+  // is finished after its last read
+  err = clWaitForEvents(1,&slot.download);
+  assert(err == CL_SUCCESS);
+  clReleaseEvent(slot.download);
+
+  slot.state=FREE;
+  ndone++;
+
+}
+
+//  van der corput sequence
+float corput(int n,int k1,int k2){
+  float corput=0;
+  float s=1;
+  while(n>0){
+    s/=k1;
+    corput+=(k2*n%k1)%k1*s;
+    n/=k1;
+  }
+  return corput;
+}
+
+
+// the programs of the contexts and devices
+map<pair<cl_context,cl_device_id>,cl_program> CLProgramCache::programs;
+pthread_mutex_t CLProgramCache::lock=PTHREAD_MUTEX_INITIALIZER;
+
+// get the program (read and build it at the first call)
+cl_program CLProgramCache::Get(cl_context ctx,cl_device_id dev){
+
+  pthread_mutex_lock(&lock);
+
+  pair<cl_context,cl_device_id> key(ctx,dev);
+  if (programs.count(key) > 0) {
+    cl_program Program=programs[key];
+    clRetainProgram(Program);
+    pthread_mutex_unlock(&lock);
+    return Program;
+  }
+
+  //read the program
+  string prog;   // program
+  string ligne;   // source file line reading
+  // kernel sources are in CLRadixsort.cl and we add at the beginning the
+  // file CLRadixSortParam.hpp
+  // (in the directory CLRADIXSORT_DIR if it is set, else the current one)
+  string dir;
+  if (getenv("CLRADIXSORT_DIR") != NULL) dir=string(getenv("CLRADIXSORT_DIR"))+"/";
+  ifstream fichierprog((dir+"CLRadixSortParam.hpp").c_str(),ios::in);
+  assert(fichierprog && "Le fichier n'existe pas");  
+  while(!fichierprog.eof()){
+    getline(fichierprog,ligne);
+    prog=prog+ligne+"\n";
+  }
+  fichierprog.close();
+
+  fichierprog.open((dir+"CLRadixSort.cl").c_str(),ios::in);
+  assert(fichierprog && "Le fichier n'existe pas"); 
+  while(!fichierprog.eof()){
+    getline(fichierprog,ligne);
+    prog=prog+ligne+"\n";
+  }
+  fichierprog.close();
+
+
+  cl_int err;
+
+  cl_program Program = clCreateProgramWithSource(ctx, 1, (const char **)&prog, NULL, &err);
+  if (!Program) {
+    cout << "failed to create compute program" << endl;
+  }
+
+  assert(err == CL_SUCCESS);
+
+  // kernel compilation
+
+  // with flags
+  // #ifdef MAC
+  //     const char *flags = "-DMAC -cl-fast-relaxed-math";
+  // #else
+  //     const char *flags = "-cl-fast-relaxed-math";
+  // #endif
+  //   err = clBuildProgram(Program, 0, NULL, flags, NULL, NULL);
+
+  // without flag
+  err = clBuildProgram(Program, 0, NULL, NULL, NULL, NULL);
+  // if not successful display the errors 
+  if (err != CL_SUCCESS) { 
+    size_t len;
+    char buffer[2048];
+    cout << "failed to build program executable"<<endl;
+    clGetProgramBuildInfo(Program, dev, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+    cout << endl<< buffer<<endl;
+    assert( err == CL_SUCCESS);
+  }
+
+  // one reference for the cache and one for the caller
+  programs[key]=Program;
+  clRetainProgram(Program);
+
+  pthread_mutex_unlock(&lock);
+
+  return Program;
+
+}
+
+// release the programs of a context
+void CLProgramCache::Purge(cl_context ctx){
+
+  pthread_mutex_lock(&lock);
+
+  map<pair<cl_context,cl_device_id>,cl_program>::iterator it=programs.begin();
+  while(it != programs.end()){
+    if (it->first.first == ctx) {
+      clReleaseProgram(it->second);
+      programs.erase(it++);
+    }
+    else it++;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+}
+
+
+// the pools of the contexts
+map<cl_context,CLBufferPool::Pool> CLBufferPool::pools;
+pthread_mutex_t CLBufferPool::lock=PTHREAD_MUTEX_INITIALIZER;
+
+// a new user of the pool of the context
+void CLBufferPool::Register(cl_context ctx){
+
+  pthread_mutex_lock(&lock);
+  pools[ctx].users++;
+  pthread_mutex_unlock(&lock);
+
+}
+
+// the last user of the pool frees all the lists
+void CLBufferPool::Unregister(cl_context ctx){
+
+  pthread_mutex_lock(&lock);
+
+  Pool& pool=pools[ctx];
+
+  assert(pool.users > 0);
+  pool.users--;
+
+  if (pool.users == 0) {
+    for(size_t i=0;i<pool.lists.size();i++){
+      assert(!pool.lists[i].used);
+      clReleaseMemObject(pool.lists[i].buf);
+    }
+    pools.erase(ctx);
+  }
+
+  pthread_mutex_unlock(&lock);
+
+}
+
+// take a free list of (at least) the given size
+// or allocate a new one
+cl_mem CLBufferPool::Acquire(cl_context ctx,size_t size,bool exact){
+
+  pthread_mutex_lock(&lock);
+
+  Pool& pool=pools[ctx];
+
+  // smallest free list that is large enough
+  // (but not more than twice the size, or of the exact size)
+  int best=-1;
+  for(size_t i=0;i<pool.lists.size();i++){
+    Entry& e=pool.lists[i];
+    if (!e.used && e.size >= size && e.size <= (exact ? size : 2*size) &&
+	(best < 0 || e.size < pool.lists[best].size)) {
+      best=i;
+    }
+  }
+
+  if (best < 0) {
+    cl_int err;
+    Entry e;
+    e.buf = clCreateBuffer(ctx,
+			   CL_MEM_READ_WRITE,
+			   size,
+			   NULL,
+			   &err);
+    assert(err == CL_SUCCESS);
+    e.size=size;
+    e.used=false;
+    pool.lists.push_back(e);
+    pool.mem += size;
+    pool.mem_peak=max(pool.mem_peak,pool.mem);
+    best=pool.lists.size()-1;
+  }
+
+  pool.lists[best].used=true;
+  cl_mem buf=pool.lists[best].buf;
+
+  pthread_mutex_unlock(&lock);
+
+  return buf;
+
+}
+
+// give a list back to the pool
+void CLBufferPool::Release(cl_context ctx,cl_mem buf){
+
+  if (buf == NULL) return;
+
+  pthread_mutex_lock(&lock);
+
+  Pool& pool=pools[ctx];
+
+  for(size_t i=0;i<pool.lists.size();i++){
+    if (pool.lists[i].buf == buf) {
+      assert(pool.lists[i].used);
+      pool.lists[i].used=false;
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+  assert(1==2 && "the list does not belong to the pool");
+
+}
+
+// replace a used list of the pool by another list of the same size
+void CLBufferPool::Exchange(cl_context ctx,cl_mem buf,cl_mem newbuf){
+
+  if (buf == NULL || buf == newbuf) return;
+
+  pthread_mutex_lock(&lock);
+
+  Pool& pool=pools[ctx];
+
+  for(size_t i=0;i<pool.lists.size();i++){
+    if (pool.lists[i].buf == buf) {
+      assert(pool.lists[i].used);
+      size_t size;
+      cl_int err;
+      err=clGetMemObjectInfo(newbuf,CL_MEM_SIZE,sizeof(size_t),&size,NULL);
+      assert(err == CL_SUCCESS);
+      // (the real size of the new list is kept)
+      pool.mem += size-pool.lists[i].size;
+      pool.mem_peak=max(pool.mem_peak,pool.mem);
+      pool.lists[i].buf=newbuf;
+      pool.lists[i].size=size;
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+  assert(1==2 && "the list does not belong to the pool");
+
+}
+
+// free the unused lists of the pool
+void CLBufferPool::Purge(cl_context ctx){
+
+  pthread_mutex_lock(&lock);
+
+  Pool& pool=pools[ctx];
+
+  vector<Entry> kept;
+  for(size_t i=0;i<pool.lists.size();i++){
+    if (pool.lists[i].used) {
+      kept.push_back(pool.lists[i]);
+    }
+    else {
+      clReleaseMemObject(pool.lists[i].buf);
+      pool.mem -= pool.lists[i].size;
+    }
+  }
+  pool.lists=kept;
+
+  pthread_mutex_unlock(&lock);
+
+}
+
+// memory allocated by the pool (current and peak values)
+size_t CLBufferPool::Memory(cl_context ctx){
+
+  pthread_mutex_lock(&lock);
+  size_t mem=pools[ctx].mem;
+  pthread_mutex_unlock(&lock);
+
+  return mem;
+
+}
+
+size_t CLBufferPool::MemoryPeak(cl_context ctx){
+
+  pthread_mutex_lock(&lock);
+  size_t mem=pools[ctx].mem_peak;
+  pthread_mutex_unlock(&lock);
+
+  return mem;
+
+}
+
+CLPrimitives::CLPrimitives(cl_context GPUContext,
+			   cl_device_id dev,
+			   cl_command_queue CommandQue) :
+  Context(GPUContext),
+  CommandQueue(CommandQue){
+
+  Program=CLProgramCache::Get(Context,dev);
+  CLBufferPool::Register(Context);
+
+  cl_int err;
+
+  ckScanBlocks = clCreateKernel(Program, "scanblocks", &err);
+  assert(err == CL_SUCCESS);
+  ckAddBlockSums = clCreateKernel(Program, "addblocksums", &err);
+  assert(err == CL_SUCCESS);
+  ckHistoBins = clCreateKernel(Program, "histobins", &err);
+  assert(err == CL_SUCCESS);
+  ckCompactScatter = clCreateKernel(Program, "compactscatter", &err);
+  assert(err == CL_SUCCESS);
+
+  cl_ulong mem;
+  err = clGetDeviceInfo(dev,CL_DEVICE_LOCAL_MEM_SIZE,sizeof(cl_ulong),&mem,NULL);
+  assert(err == CL_SUCCESS);
+  localMem=mem;
+  assert(localMem >= sizeof(uint)*_PRIMBLOCK);
+
+  scan_time=0;
+  histo_time=0;
+  compact_time=0;
+
+  tracer=NULL;
+
+}
+
+CLPrimitives::~CLPrimitives(){
+
+  clReleaseKernel(ckScanBlocks);
+  clReleaseKernel(ckAddBlockSums);
+  clReleaseKernel(ckHistoBins);
+  clReleaseKernel(ckCompactScatter);
+  clReleaseProgram(Program);
+  CLBufferPool::Unregister(Context);
+
+}
+
+void CLPrimitives::Trace(cl_event eve,const char* name,size_t bytes){
+
+  if (tracer != NULL) tracer->Trace(eve,name,bytes);
+
+}
+
+// launch a kernel on a 1D range and add its duration to the timer
+void CLPrimitives::Launch(cl_kernel kernel,const char* name,
+			  size_t nbitems,size_t nblocitems,float* timer){
+
+  cl_int err;
+  cl_event eve;
+  cl_ulong debut,fin;
+
+  err = clEnqueueNDRangeKernel(CommandQueue,
+			       kernel,
+			       1, NULL,
+			       &nbitems,
+			       &nblocitems,
+			       0, NULL, &eve);
+  assert(err== CL_SUCCESS);
+  clFinish(CommandQueue);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
+			       (void*) &debut,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  err=clGetEventProfilingInfo (eve,
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
+			       (void*) &fin,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  *timer += (float) (fin-debut)/1e9;
+  Trace(eve,name);
+
+  clReleaseEvent(eve);
+
+}
+
+uint CLPrimitives::Scan(cl_mem d_in,cl_mem d_out,uint n,bool inclusive){
+
+  return ScanLevel(d_in,d_out,n,inclusive,false);
+
+}
+
+// the blocks of _PRIMBLOCK values are scanned, then the sums of the
+// blocks (scanned at the next level) are added to the blocks
+uint CLPrimitives::ScanLevel(cl_mem d_in,cl_mem d_out,uint n,
+			     bool inclusive,bool predicate){
+
+  if (n == 0) return 0;
+
+  cl_int err;
+
+  uint nblocks=(n+_PRIMBLOCK-1)/_PRIMBLOCK;
+  cl_mem d_sums=CLBufferPool::Acquire(Context,sizeof(uint)*nblocks);
+
+  int incl=inclusive;
+  int pred=predicate;
+
+  err  = clSetKernelArg(ckScanBlocks, 0, sizeof(cl_mem), &d_in);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckScanBlocks, 1, sizeof(cl_mem), &d_out);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckScanBlocks, 2, sizeof(cl_mem), &d_sums);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckScanBlocks, 3, sizeof(uint)*_PRIMBLOCK, NULL);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckScanBlocks, 4, sizeof(uint), &n);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckScanBlocks, 5, sizeof(int), &incl);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckScanBlocks, 6, sizeof(int), &pred);
+  assert(err == CL_SUCCESS);
+
+  Launch(ckScanBlocks,"scanblocks",nblocks*_PRIMBLOCK/2,_PRIMBLOCK/2,&scan_time);
+
+  uint total;
+  if (nblocks == 1) {
+    cl_event eve;
+    err = clEnqueueReadBuffer(CommandQueue,
+			      d_sums,
+			      CL_TRUE, 0,
+			      sizeof(uint),
+			      &total,
+			      0, NULL, &eve);
+    assert(err == CL_SUCCESS);
+    Trace(eve,"scantotal",sizeof(uint));
+    clReleaseEvent(eve);
+  }
+  else {
+    // exclusive scan of the sums of the blocks
+    total=ScanLevel(d_sums,d_sums,nblocks,false,false);
+
+    err  = clSetKernelArg(ckAddBlockSums, 0, sizeof(cl_mem), &d_out);
+    assert(err == CL_SUCCESS);
+    err  = clSetKernelArg(ckAddBlockSums, 1, sizeof(cl_mem), &d_sums);
+    assert(err == CL_SUCCESS);
+    err = clSetKernelArg(ckAddBlockSums, 2, sizeof(uint), &n);
+    assert(err == CL_SUCCESS);
+
+    Launch(ckAddBlockSums,"addblocksums",nblocks*_PRIMBLOCK/2,_PRIMBLOCK/2,&scan_time);
+  }
+
+  CLBufferPool::Release(Context,d_sums);
+
+  return total;
+
+}
+
+void CLPrimitives::Histogram(cl_mem d_keys,uint n,cl_mem d_histo,uint nbins){
+
+  if (nbins == 0) return;
+
+  cl_int err;
+
+  vector<uint> zero(nbins,0);
+  cl_event eve;
+  err = clEnqueueWriteBuffer(CommandQueue,
+			     d_histo,
+			     CL_TRUE, 0,
+			     sizeof(uint)*nbins,
+			     &zero[0],
+			     0, NULL, &eve);
+  assert(err == CL_SUCCESS);
+  Trace(eve,"histozero",sizeof(uint)*nbins);
+  clReleaseEvent(eve);
+
+  // local counts if they fit in the local memory
+  int uselocal= (nbins <= _PRIMBINS && sizeof(uint)*nbins <= localMem);
+
+  err  = clSetKernelArg(ckHistoBins, 0, sizeof(cl_mem), &d_keys);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckHistoBins, 1, sizeof(uint), &n);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckHistoBins, 2, sizeof(cl_mem), &d_histo);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckHistoBins, 3, sizeof(uint), &nbins);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckHistoBins, 4, uselocal ? sizeof(uint)*nbins : sizeof(uint), NULL);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckHistoBins, 5, sizeof(int), &uselocal);
+  assert(err == CL_SUCCESS);
+
+  Launch(ckHistoBins,"histobins",_GROUPS*_ITEMS,_ITEMS,&histo_time);
+
+}
+
+uint CLPrimitives::Compact(cl_mem d_in,cl_mem d_flags,uint n,cl_mem d_out){
+
+  if (n == 0) return 0;
+
+  cl_int err;
+
+  // positions of the kept values
+  cl_mem d_pos=CLBufferPool::Acquire(Context,sizeof(uint)*n);
+  float t=scan_time;
+  uint count=ScanLevel(d_flags,d_pos,n,false,true);
+  compact_time += scan_time-t;
+  scan_time=t;
+
+  err  = clSetKernelArg(ckCompactScatter, 0, sizeof(cl_mem), &d_in);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckCompactScatter, 1, sizeof(cl_mem), &d_flags);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckCompactScatter, 2, sizeof(cl_mem), &d_pos);
+  assert(err == CL_SUCCESS);
+  err  = clSetKernelArg(ckCompactScatter, 3, sizeof(cl_mem), &d_out);
+  assert(err == CL_SUCCESS);
+  err = clSetKernelArg(ckCompactScatter, 4, sizeof(uint), &n);
+  assert(err == CL_SUCCESS);
+
+  Launch(ckCompactScatter,"compactscatter",(n+_ITEMS-1)/_ITEMS*_ITEMS,_ITEMS,&compact_time);
+
+  CLBufferPool::Release(Context,d_pos);
+
+  return count;
+
+}
+
+// plan of the sort: all the launches are prepared here
+CLRadixSortPlan::CLRadixSortPlan(CLRadixSort* r,uint n,uint maxkey) :
+  rs(r){
+
+#ifdef SINGLESCRATCH
+  assert(false && "no plan with SINGLESCRATCH");
+#endif
+
+  cl_int err;
+
+  rs->Resize(n);
+
+  // the same number of passes as CLRadixSort::Sort
+  npass=1;
+  while(npass < _PASS && (maxkey >> (npass * _BITS)) != 0) npass++;
+
+  d_outKeys=NULL;
+  d_outPermut=NULL;
+  d_Histograms=NULL;
+  d_globsum=NULL;
+  d_temp=NULL;
+
+  d_inKeys=rs->d_inKeys;
+  cl_mem d_inPermut=rs->d_inPermut;
+  nkeys=rs->nkeys;
+  uint nkeys_rounded=rs->nkeys_rounded;
+
+  if (nkeys <= rs->smallsort) {
+    // small list: a single kernel in place
+    cl_kernel k=Kernel("smallsort");
+    err  = clSetKernelArg(k, 0, sizeof(cl_mem), &d_inKeys);
+    assert(err == CL_SUCCESS);
+    err  = clSetKernelArg(k, 1, sizeof(cl_mem), &d_inPermut);
+    assert(err == CL_SUCCESS);
+    err = clSetKernelArg(k, 2, sizeof(uint), &nkeys);
+    assert(err == CL_SUCCESS);
+    err  = clSetKernelArg(k, 3, sizeof(uint)*_SMALLSORT, NULL);
+    assert(err == CL_SUCCESS);
+    err  = clSetKernelArg(k, 4, sizeof(uint)*_SMALLSORT, NULL);
+    assert(err == CL_SUCCESS);
+    Add(k,"smallsort",-1,_ITEMS,_ITEMS);
+    d_resKeys=d_inKeys;
+    d_resPermut=d_inPermut;
+  }
+  else {
+    d_outKeys=rs->CreateBuffer(sizeof(keytype)* _N);
+#ifdef PERMUT
+    d_outPermut=rs->CreateBuffer(sizeof(uint)* _N);
+#endif
+    d_Histograms=rs->CreateBuffer(sizeof(uint)* _HISTOSIZE);
+    d_globsum=rs->CreateBuffer(sizeof(uint)* _HISTOSPLIT);
+    d_temp=rs->CreateBuffer(sizeof(uint));
+
+    // the scans do not depend on the pass
+    int maxmemcache=max(_HISTOSPLIT,_HISTOSIZE / _HISTOSPLIT);
+
+    cl_kernel scan1=Kernel("scanhistograms");
+    err = clSetKernelArg(scan1, 0, sizeof(cl_mem), &d_Histograms);
+    assert(err == CL_SUCCESS);
+    err  = clSetKernelArg(scan1, 1, sizeof(uint)* maxmemcache, NULL);
+    assert(err == CL_SUCCESS);
+    err = clSetKernelArg(scan1, 2, sizeof(cl_mem), &d_globsum);
+    assert(err == CL_SUCCESS);
+
+    cl_kernel scan2=Kernel("scanhistograms");
+    err = clSetKernelArg(scan2, 0, sizeof(cl_mem), &d_globsum);
+    assert(err == CL_SUCCESS);
+    err  = clSetKernelArg(scan2, 1, sizeof(uint)* maxmemcache, NULL);
+    assert(err == CL_SUCCESS);
+    err = clSetKernelArg(scan2, 2, sizeof(cl_mem), &d_temp);
+    assert(err == CL_SUCCESS);
+
+    cl_kernel paste=Kernel("pastehistograms");
+    err = clSetKernelArg(paste, 0, sizeof(cl_mem), &d_Histograms);
+    assert(err == CL_SUCCESS);
+    err = clSetKernelArg(paste, 1, sizeof(cl_mem), &d_globsum);
+    assert(err == CL_SUCCESS);
+
+    // the lists are exchanged after each pass
+    cl_mem keys[2]={d_inKeys,d_outKeys};
+    cl_mem perm[2]={d_inPermut,d_outPermut};
+
+    for(uint pass=0;pass<npass;pass++){
+      int src=pass%2;
+
+      cl_kernel histo=Kernel("histogram");
+      err  = clSetKernelArg(histo, 0, sizeof(cl_mem), &keys[src]);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(histo, 1, sizeof(cl_mem), &d_Histograms);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(histo, 2, sizeof(uint), &pass);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(histo, 3, sizeof(uint)*_LOCALSIZE, NULL);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(histo, 4, sizeof(uint), &nkeys_rounded);
+      assert(err == CL_SUCCESS);
+      Add(histo,"histogram",pass,_GROUPS*_ITEMS,_ITEMS);
+
+      Add(scan1,"scanhistograms",pass,_HISTOSIZE/2,_HISTOSIZE/2/_HISTOSPLIT);
+      Add(scan2,"scanhistograms",pass,_HISTOSPLIT/2,_HISTOSPLIT/2);
+      Add(paste,"pastehistograms",pass,_HISTOSIZE/2,_HISTOSIZE/2/_HISTOSPLIT);
+
+      cl_kernel reorder=Kernel("reorder");
+      err  = clSetKernelArg(reorder, 0, sizeof(cl_mem), &keys[src]);
+      assert(err == CL_SUCCESS);
+      err  = clSetKernelArg(reorder, 1, sizeof(cl_mem), &keys[1-src]);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(reorder, 2, sizeof(cl_mem), &d_Histograms);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(reorder, 3, sizeof(uint), &pass);
+      assert(err == CL_SUCCESS);
+      err  = clSetKernelArg(reorder, 4, sizeof(cl_mem), &perm[src]);
+      assert(err == CL_SUCCESS);
+      err  = clSetKernelArg(reorder, 5, sizeof(cl_mem), &perm[1-src]);
+      assert(err == CL_SUCCESS);
+      err  = clSetKernelArg(reorder, 6, sizeof(uint)* _LOCALSIZE, NULL);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(reorder, 7, sizeof(uint), &nkeys_rounded);
+      assert(err == CL_SUCCESS);
+      err = clSetKernelArg(reorder, 8, sizeof(uint), &npass);
+      assert(err == CL_SUCCESS);
+      Add(reorder,"reorder",pass,_GROUPS*_ITEMS,_ITEMS);
+    }
+
+    d_resKeys=keys[npass%2];
+    d_resPermut=perm[npass%2];
+  }
+
+  if (rs->ncells > 0) {
+    cl_kernel k=Kernel("celloffsets");
+    err  = clSetKernelArg(k, 0, sizeof(cl_mem), &d_resKeys);
+    assert(err == CL_SUCCESS);
+    err  = clSetKernelArg(k, 1, sizeof(cl_mem), &rs->d_CellOffsets);
+    assert(err == CL_SUCCESS);
+    err = clSetKernelArg(k, 2, sizeof(uint), &nkeys);
+    assert(err == CL_SUCCESS);
+    err = clSetKernelArg(k, 3, sizeof(uint), &rs->ncells);
+    assert(err == CL_SUCCESS);
+    Add(k,"celloffsets",-1,(nkeys+1+_ITEMS-1)/_ITEMS*_ITEMS,_ITEMS);
+  }
+
+  // record the launches in a command buffer if possible
+  commandbuffer=false;
+#ifdef cl_khr_command_buffer
+  cmdbuf=NULL;
+  size_t len;
+  clGetDeviceInfo(rs->NumDevice,CL_DEVICE_EXTENSIONS,0,NULL,&len);
+  string ext(len,' ');
+  clGetDeviceInfo(rs->NumDevice,CL_DEVICE_EXTENSIONS,len,&ext[0],NULL);
+  if (ext.find("cl_khr_command_buffer") != string::npos) {
+    cl_platform_id platform;
+    clGetDeviceInfo(rs->NumDevice,CL_DEVICE_PLATFORM,sizeof(platform),&platform,NULL);
+    clCreateCommandBufferKHR_fn CreateCommandBuffer=(clCreateCommandBufferKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(platform,"clCreateCommandBufferKHR");
+    clCommandNDRangeKernelKHR_fn CommandNDRangeKernel=(clCommandNDRangeKernelKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(platform,"clCommandNDRangeKernelKHR");
+    clFinalizeCommandBufferKHR_fn FinalizeCommandBuffer=(clFinalizeCommandBufferKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(platform,"clFinalizeCommandBufferKHR");
+    EnqueueCommandBuffer=(clEnqueueCommandBufferKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(platform,"clEnqueueCommandBufferKHR");
+    ReleaseCommandBuffer=(clReleaseCommandBufferKHR_fn)
+      clGetExtensionFunctionAddressForPlatform(platform,"clReleaseCommandBufferKHR");
+    if (CreateCommandBuffer && CommandNDRangeKernel && FinalizeCommandBuffer &&
+	EnqueueCommandBuffer && ReleaseCommandBuffer) {
+      cmdbuf=CreateCommandBuffer(1,&rs->CommandQueue,NULL,&err);
+      bool ok= (err == CL_SUCCESS);
+      // (the launches of an in-order queue are executed in order)
+      for(uint i=0;ok && i<launches.size();i++){
+	err=CommandNDRangeKernel(cmdbuf,NULL,NULL,launches[i].kernel,1,NULL,
+				 &launches[i].nbitems,&launches[i].nblocitems,
+				 0,NULL,NULL,NULL);
+	ok= (err == CL_SUCCESS);
+      }
+      ok = ok && (FinalizeCommandBuffer(cmdbuf) == CL_SUCCESS);
+      if (ok) commandbuffer=true;
+      else if (cmdbuf != NULL) {
+	ReleaseCommandBuffer(cmdbuf);
+	cmdbuf=NULL;
+      }
+    }
+  }
+#endif
+
+  if (VERBOSE) {
+    cout << "sort plan of "<<nkeys<<" keys: "<<npass<<" passes, "
+	 <<launches.size()<<" launches"
+	 <<(commandbuffer ? " in a command buffer" : "")<<endl;
+  }
+
+  sort_time=0;
+
+}
+
+CLRadixSortPlan::~CLRadixSortPlan(){
+
+#ifdef cl_khr_command_buffer
+  if (commandbuffer) ReleaseCommandBuffer(cmdbuf);
+#endif
+  for(uint i=0;i<kernels.size();i++){
+    clReleaseKernel(kernels[i]);
+  }
+  rs->ReleaseBuffer(d_outKeys);
+  rs->ReleaseBuffer(d_outPermut);
+  rs->ReleaseBuffer(d_Histograms);
+  rs->ReleaseBuffer(d_globsum);
+  rs->ReleaseBuffer(d_temp);
+
+}
+
+cl_kernel CLRadixSortPlan::Kernel(const char* name){
+
+  cl_int err;
+  cl_kernel k=clCreateKernel(rs->Program, name, &err);
+  assert(err == CL_SUCCESS);
+  kernels.push_back(k);
+  return k;
+
+}
+
+void CLRadixSortPlan::Add(cl_kernel kernel,const char* name,int pass,
+			  size_t nbitems,size_t nblocitems){
+
+  Launch l;
+  l.kernel=kernel;
+  l.name=name;
+  l.pass=pass;
+  l.nbitems=nbitems;
+  l.nblocitems=nblocitems;
+  launches.push_back(l);
+
+}
+
+// replay of the plan: only the enqueues (or the command buffer)
+void CLRadixSortPlan::Sort(void){
+
+  // the list of the object has not changed since the creation
+  assert(d_inKeys == rs->d_inKeys && nkeys == rs->nkeys);
+
+  cl_int err;
+  cl_command_queue queue=rs->CommandQueue;
+  cl_event first,last;
+
+#ifdef cl_khr_command_buffer
+  if (commandbuffer) {
+    err=EnqueueCommandBuffer(1,&queue,cmdbuf,0,NULL,&first);
+    assert(err == CL_SUCCESS);
+    rs->Trace(first,"commandbuffer");
+    clRetainEvent(first);
+    last=first;
+  }
+  else
+#endif
+  {
+    for(uint i=0;i<launches.size();i++){
+      cl_event eve;
+      err = clEnqueueNDRangeKernel(queue,
+				   launches[i].kernel,
+				   1, NULL,
+				   &launches[i].nbitems,
+				   &launches[i].nblocitems,
+				   0, NULL, &eve);
+      assert(err== CL_SUCCESS);
+      rs->curpass=launches[i].pass;
+      rs->Trace(eve,launches[i].name);
+      // only the first and the last events are kept
+      if (i == 0) {
+	first=eve;
+	clRetainEvent(first);
+      }
+      if (i+1 < launches.size()) clReleaseEvent(eve);
+      else last=eve;
+    }
+    rs->curpass=-1;
+  }
+
+  // odd number of passes: the sorted list is in the scratch lists
+  if (d_resKeys != rs->d_inKeys) {
+    clReleaseEvent(last);
+    err = clEnqueueCopyBuffer(queue,d_resKeys,rs->d_inKeys,0,0,
+			      sizeof(keytype)*rs->nkeys_rounded,0,NULL,&last);
+    assert(err == CL_SUCCESS);
+    rs->Trace(last,"copykeys",sizeof(keytype)*rs->nkeys_rounded);
+#ifdef PERMUT
+    clReleaseEvent(last);
+    err = clEnqueueCopyBuffer(queue,d_resPermut,rs->d_inPermut,0,0,
+			      sizeof(uint)*rs->nkeys_rounded,0,NULL,&last);
+    assert(err == CL_SUCCESS);
+    rs->Trace(last,"copypermut",sizeof(uint)*rs->nkeys_rounded);
+#endif
+  }
+
+  clFinish(queue);
+
+  cl_ulong debut,fin;
+
+  err=clGetEventProfilingInfo (first,
+			       CL_PROFILING_COMMAND_QUEUED,
+			       sizeof(cl_ulong),
+			       (void*) &debut,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  err=clGetEventProfilingInfo (last,
+			       CL_PROFILING_COMMAND_END,
+			       sizeof(cl_ulong),
+			       (void*) &fin,
+			       NULL);
+  assert(err== CL_SUCCESS);
+
+  sort_time = (float) (fin-debut)/1e9;
+
+  clReleaseEvent(first);
+  clReleaseEvent(last);
+
+}
@@ -14,7 +14,7 @@
 // compilation for Mac:
 //g++ CLRadixSort.cpp CLRadixSortMain.cpp -framework opencl -Wall
 // compilation for Linux:
-//g++ CLRadixSort.cpp CLRadixSortMain.cpp -lOpenCL -Wall
+//g++ CLRadixSort.cpp CLRadixSortMain.cpp -lOpenCL -lpthread -Wall
 
 #ifndef _CLRADIXSORT
 #define _CLRADIXSORT
@@ -30,6 +30,15 @@
 
 typedef cl_uint uint;
 
+// type of the keys in the lists (see _KEYBITS)
+#if _KEYBITS == 8
+typedef cl_uchar keytype;
+#elif _KEYBITS == 16
+typedef cl_ushort keytype;
+#else
+typedef cl_uint keytype;
+#endif
+
 
 #include <string>
 #include<fstream>
@@ -37,10 +46,93 @@ typedef cl_uint uint;
 #include<assert.h>
 #include<math.h>
 #include <stdlib.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <pthread.h>
 
 using namespace std;
 
 
+// cache of the built programs: the kernels source is read and compiled
+// once per context and device, and shared by all the objects
+// several host threads can sort at the same time on one context, each
+// with its own CLRadixSort object and command queue (an object has its
+// own kernels and state and is used by one thread at a time)
+class CLProgramCache{
+
+public:
+  // the program of the context and the device (built at the first call)
+  // the caller owns a reference (to be released with clReleaseProgram)
+  static cl_program Get(cl_context ctx,cl_device_id dev);
+
+  // the cache releases its references to the programs of the context
+  static void Purge(cl_context ctx);
+
+private:
+  static map<pair<cl_context,cl_device_id>,cl_program> programs;
+  static pthread_mutex_t lock;
+
+};
+
+
+// pool of device lists shared by the CLRadixSort objects of a context
+// the scratch lists are taken from the pool at the beginning of a sort
+// and given back at the end, so that the used memory is bounded by the
+// maximal concurrent need and not by the number of objects
+// (the pool can be used by several host threads)
+class CLBufferPool{
+
+public:
+  // a CLRadixSort object starts or stops using the pool of the context
+  // (the lists are freed when the last user stops)
+  static void Register(cl_context ctx);
+  static void Unregister(cl_context ctx);
+
+  // take a list of (at least) size bytes / give it back
+  // (exact: of size bytes, for a list exchanged with a list of the user)
+  static cl_mem Acquire(cl_context ctx,size_t size,bool exact=false);
+  static void Release(cl_context ctx,cl_mem buf);
+
+  // the used list buf of the pool is replaced by newbuf
+  // (a list that the user exchanged with it, normally of the same size)
+  static void Exchange(cl_context ctx,cl_mem buf,cl_mem newbuf);
+
+  // free the unused lists
+  static void Purge(cl_context ctx);
+
+  // memory allocated by the pool (current and peak values)
+  static size_t Memory(cl_context ctx);
+  static size_t MemoryPeak(cl_context ctx);
+
+private:
+  struct Entry{
+    cl_mem buf;
+    size_t size;
+    bool used;
+  };
+  struct Pool{
+    int users;
+    size_t mem,mem_peak;
+    vector<Entry> lists;
+    Pool() : users(0),mem(0),mem_peak(0) {};
+  };
+  static map<cl_context,Pool> pools;
+  static pthread_mutex_t lock;
+
+};
+
+#ifdef TRACE
+// a command recorded for the trace
+struct TraceEvent{
+  cl_event eve;       // the times are read at the end
+  const char* name;
+  int pass;           // pass of the sort (-1 if none)
+  uint nkeys;         // size of the list
+  size_t bytes;       // size of a transfer (0 for a kernel)
+};
+#endif
+
 class CLRadixSort{
 
 
@@ -60,24 +152,67 @@ public:
 
   // this function treats the array d_Keys on the GPU
   // and return the sorting permutation in the array d_Permut
-  void Sort();
+  // if all the keys are <= maxkey, only the passes of its digits are
+  // done (a single counting sort pass for keys smaller than _RADIX)
+  void Sort(uint maxkey=_KEYMASK);
+
+  // largest key of the list (computed on the device)
+  // for instance: Sort(MaxKey())
+  uint MaxKey(void);
+
+  // sort of a list of at most smallsort keys by one work group
+  // (called by Sort for the small lists)
+  void SmallSort(void);
 
   // get the data from the GPU (for debugging)
+  // (the nkeys keys, the permutation, the histograms)
+  // the histograms are read only while the scratch lists are held:
+  // after a Sort, h_Histograms and h_globsum are those of its last
+  // pass if VERBOSE is set, else those of an older call
   void RecupGPU(void);
+  // get the histograms (while the scratch lists are held)
+  void RecupHistograms(void);
 
-  // put the data on the host in the GPU
+  // put the data on the host in the GPU (the nkeys keys and the permutation)
   void Host2GPU(void);
 
+  // non blocking transfers of the keys first..first+count-1 of the list
+  // (and of the permutation if permut is not NULL) on the queue
+  // (the queue of the object if NULL, it has to be in order)
+  // the returned event is the end of the transfers (to be released
+  // with clReleaseEvent); the host arrays have to remain valid until then
+  cl_event RecupKeys(uint first,uint count,keytype* keys,uint* permut=NULL,
+		     cl_command_queue queue=NULL);
+  cl_event SendKeys(uint first,uint count,const keytype* keys,const uint* permut=NULL,
+		    cl_command_queue queue=NULL);
+
   // check that the sort is successfull (for debugging)
   void Check(void);
 
+  // order-independent checksum of the keys, computed on the device
+  // (to be compared after the sort by DeviceCheck)
+  uint KeysChecksum(void);
+
+  // check the sort on the device (only two values are read back):
+  // return true if the list is sorted and if the checksum of its keys
+  // is equal to checksum (the KeysChecksum before the sort)
+  // firstviolation is the first i with key[i] > key[i+1] (nkeys if none)
+  bool DeviceCheck(uint checksum,uint* firstviolation=NULL);
+
+  // first unsorted index and checksum of the keys in result[0..1]
+  void CheckKeys(uint* result);
+
+  // record the command of the event eve for the trace (with TRACE):
+  // name, pass of the sort, number of keys and bytes of a transfer
+  // (at most _TRACEMAX commands between two WriteTrace)
+  void Trace(cl_event eve,const char* name,size_t bytes=0);
+  // write the recorded commands in a Chrome trace file
+  // (chrome://tracing or Perfetto) and clear the record
+  void WriteTrace(const char* filename);
+
   // sort a set of particles (for debugging)
   void PICSorting(void);
 
-  // transpose the list for faster memeory access
-  // (improve coalescence)
-  void Transpose(int nbrow,int nbcol);
-
   // compute the histograms for one pass
   void Histogram(uint pass);
   // scan the histograms
@@ -85,12 +220,95 @@ public:
   // scan the histograms
   void Reorder(uint pass);
 
+  // destinations of the keys and permutation of a reordering
+  // (return the number of kernel calls)
+  int OutputLists(cl_mem* d_keysdest,cl_mem* d_permsrc,cl_mem* d_permdest);
+  // exchange the input and output lists after a reordering
+  void SwapLists(void);
+
+  // radix selection (MSD order): return the k-th smallest key
+  // (k=0 for the smallest) of the list, without sorting it
+  uint Select(uint k);
+
+  // put the k smallest keys of the list (in no particular order)
+  // in d_topKeys (and their permutation in d_topPermut, needed with
+  // PERMUT): device lists of at least k values given by the caller
+  // the list itself is not modified
+  void TopK(uint k,cl_mem d_topKeys,cl_mem d_topPermut=NULL);
+
+  // the keys are cell numbers in 0..nc-1 (particle-in-cell sort):
+  // after each sort, compute the table of the cells offsets
+  // (nc=0 to disable)
+  void SetCells(uint nc);
+
+  // compute the cells offsets of the sorted list: the keys of the
+  // cell c are at indices d_CellOffsets[c]..d_CellOffsets[c+1]-1
+  // (the keys >= ncells, if any, are after d_CellOffsets[ncells])
+  void CellOffsets(void);
+
+  // keys of np particles of coordinates d_x, d_y (device lists of floats)
+  // on a grid of nx*ny cells of size dx*dy and origin (x0,y0): the keys
+  // are ix*ny+iy, or the Morton codes of (ix,iy) if morton (better
+  // locality of the sorted particles), and are written on the device
+  // the histogram of the first pass of the next Sort is computed at
+  // the same time; if offsets, the cells are also set (SetCells) for
+  // the table of the cells offsets, else the cells are left to the
+  // caller (give the largest key to Sort for the number of passes)
+  // return false if the keys do not fit in _TOTALBITS bits (nothing
+  // is computed then)
+  bool CellKeys(cl_mem d_x,cl_mem d_y,uint np,
+		float x0,float y0,float dx,float dy,
+		uint nx,uint ny,bool morton=false,bool offsets=false);
+
+  // merge the sorted list with a sorted batch of nnew keys (for instance
+  // the d_inKeys and d_inPermut of another sorted CLRadixSort)
+  // the merged list replaces the list and the permutation of the batch
+  // is shifted by nkeys (indices in the concatenation of the two lists)
+  void Merge(cl_mem d_newKeys,cl_mem d_newPermut,uint nnew);
+
+#ifdef PERMUT
+  // sort nrec records of stride bytes (array of structures) by the
+  // unsigned key of keywidth bytes (1, 2 or 4, little endian) at the
+  // byte keyoffset of each record: the keys are extracted on the device,
+  // sorted, and the records are copied in d_outRecords in the order of
+  // the permutation (stable, in decreasing order if descending)
+  // the keys have to fit in _TOTALBITS bits: returns false (without
+  // sorting) if a key is larger
+  bool SortRecords(cl_mem d_inRecords,cl_mem d_outRecords,
+		   uint nrec,uint stride,
+		   uint keyoffset,uint keywidth,
+		   bool descending=false);
+
+  // lexicographic sort of nrec tuples stored in ncols device arrays of
+  // uint (d_cols[0] is the most significant column), the column c having
+  // colbits[c] bits: the adjacent columns are packed in keys of at most
+  // _TOTALBITS bits, which are sorted from the least significant one while
+  // the permutation is carried on the device
+  // the result is the permutation d_inPermut (the keys are not usable)
+  void SortColumns(int ncols,const cl_mem* d_cols,const uint* colbits,
+		   uint nrec);
+#endif
+
+
+  // take the scratch lists in the pool of the context
+  // (done by the sort, the selection and the merge)
+  void AcquireScratch(void);
+  // give them back (done at the end of the sort, the selection
+  // and the merge)
+  void ReleaseScratch(void);
+
+  // allocate or free a list on the device
+  // (the used memory is counted in devmem)
+  cl_mem CreateBuffer(size_t size);
+  void ReleaseBuffer(cl_mem d_buf);
 
   cl_context Context;             // OpenCL context
   cl_device_id NumDevice;         // OpenCL Device
   cl_command_queue CommandQueue;     // OpenCL command queue 
   cl_program Program;                // OpenCL program
-  uint h_Histograms[_RADIX * _GROUPS * _ITEMS]; // histograms on the cpu
+  bool scratch; // true if the scratch lists are taken from the pool
+  cl_mem pool_outKeys,pool_outPermut; // lists taken from the pool
+  uint h_Histograms[_HISTOSIZE]; // histograms on the cpu
   cl_mem d_Histograms;                   // histograms on the GPU
 
   // sum of the local histograms
@@ -100,9 +318,13 @@ public:
 
   // list of keys
   uint nkeys; // actual number of keys
-  uint nkeys_rounded; // next multiple of _ITEMS*_GROUPS
-  uint h_checkKeys[_N]; // a copy for check
-  uint h_Keys[_N];
+  uint nkeys_rounded; // next multiple of _PADSIZE
+  uint npass; // number of passes of the last sort
+  // largest list sorted by SmallSort: _SMALLSORT, or 0 if the
+  // local memory of the device is too small
+  uint smallsort;
+  keytype h_checkKeys[_N]; // a copy for check
+  keytype h_Keys[_N];
   cl_mem d_inKeys;
   cl_mem d_outKeys;
 
@@ -111,15 +333,210 @@ public:
   cl_mem d_inPermut;
   cl_mem d_outPermut;
 
+  // radix selection
+  cl_mem d_selKeys; // second buffer of candidates (allocated at the first selection)
+  cl_mem d_selCount; // atomic counters of the compaction (and of the reductions)
+  uint nsmaller; // number of keys smaller than the last selected key
+
+  // cells offsets (ncells+1 values)
+  uint ncells;
+
+  // the histogram of the first pass is already computed (CellKeys)
+  bool histo0;
+
+  // pass of the sort in progress (-1 outside the passes)
+  int curpass;
+
+#ifdef TRACE
+  // recorded commands
+  vector<TraceEvent> trace;
+#endif
+  cl_mem d_CellOffsets;
+
    // OpenCL kernels
-  cl_kernel ckTranspose; // transpose the initial list
   cl_kernel ckHistogram;  // compute histograms
   cl_kernel ckScanHistogram; // scan local histogram
   cl_kernel ckPasteHistogram; // paste local histograms
   cl_kernel ckReorder; // final reordering
+  cl_kernel ckSelectRadix; // compaction of the candidates of the selection
+  cl_kernel ckTopK; // copy of the k smallest keys
+  cl_kernel ckCellOffsets; // cells offsets from the sorted keys
+  cl_kernel ckMergePath; // merge of two sorted lists
+  cl_kernel ckRecordKeys; // keys of a list of records
+  cl_kernel ckReorderRecords; // records in the sorted order
+  cl_kernel ckPackKeys; // keys of a lexicographic sort
+  cl_kernel ckCellKeys; // cells keys of particles and first histogram
+  cl_kernel ckMaxKey; // largest key
+  cl_kernel ckSmallSort; // sort of a small list in local memory
+  cl_kernel ckCheckKeys; // verification of the sort
+
+  // memory used on the device (current and peak values)
+  size_t devmem,devmem_peak;
+
+  // timers
+  float histo_time,scan_time,reorder_time,sort_time;
+  float select_time,cell_time,merge_time,record_time,pack_time,maxkey_time,small_time;
+  float check_time;
+
+};
+
+
+// prebuilt sort of the list of a CLRadixSort object, for repeated sorts
+// of the same size: the kernels of each pass are created with their
+// arguments set once, and the plan only enqueues them (or a command
+// buffer with cl_khr_command_buffer, if the device has it)
+// the plan has its own scratch lists; the keys (and permutation) are
+// those of the object (SendKeys/RecupKeys), and the object must not be
+// sorted or resized by other means while the plan is used
+// (not with SINGLESCRATCH, and the first histogram of CellKeys is not used)
+class CLRadixSortPlan{
+
+public:
+  // plan of the sort of n keys not larger than maxkey
+  CLRadixSortPlan(CLRadixSort* rs,uint n,uint maxkey=_KEYMASK);
+  ~CLRadixSortPlan();
+
+  // sort the list of the object
+  void Sort(void);
+
+  float sort_time;    // GPU time of the last sort
+  bool commandbuffer; // the launches are recorded in a command buffer
+
+private:
+  // a kernel launch of the plan
+  struct Launch{
+    cl_kernel kernel;
+    const char* name;   // (for the trace)
+    int pass;           // pass of the sort (-1 if none)
+    size_t nbitems,nblocitems;
+  };
+  // create a kernel of the program for the plan
+  cl_kernel Kernel(const char* name);
+  void Add(cl_kernel kernel,const char* name,int pass,
+	   size_t nbitems,size_t nblocitems);
+
+  CLRadixSort* rs;
+  uint npass;
+  vector<cl_kernel> kernels;
+  vector<Launch> launches;
+
+  // scratch lists of the plan
+  cl_mem d_outKeys,d_outPermut,d_Histograms,d_globsum,d_temp;
+  // the sorted list is in d_resKeys at the end (copied in the list
+  // of the object if it is a scratch list)
+  cl_mem d_resKeys,d_resPermut;
+  // list of the object and its size when the plan was made
+  cl_mem d_inKeys;
+  uint nkeys;
+
+#ifdef cl_khr_command_buffer
+  cl_command_buffer_khr cmdbuf;
+  clEnqueueCommandBufferKHR_fn EnqueueCommandBuffer;
+  clReleaseCommandBufferKHR_fn ReleaseCommandBuffer;
+#endif
+
+};
+
+// pipelined sort of a stream of independent batches of keys
+// each batch is uploaded, sorted and downloaded in one of nslots
+// CLRadixSort objects: the transfers are made on a transfer queue and
+// the sorts on a compute queue, so that the upload of the batch k+1 and
+// the download of the batch k-1 overlap the sort of the batch k
+class CLSortStream{
+
+public:
+  CLSortStream(cl_context Context,
+	       cl_device_id NumDevice,
+	       int nslots=3);
+  ~CLSortStream();
+
+  // submit a batch of n keys: the sorted keys (and the permutation if
+  // PERMUT is defined) are written in sorted (and permut) when the
+  // batch is done; the three arrays must remain valid until then
+  // return the number of the batch
+  int Push(const keytype* keys,uint n,keytype* sorted,uint* permut=NULL);
+
+  // wait until all the batches are done
+  void Flush(void);
+
+  int nbatches; // number of submitted batches
+  int ndone; // number of done batches (the batches are done in order)
+
+private:
+  // state of a slot
+  enum {FREE,UPLOADED,DOWNLOADING};
+  struct Slot{
+    CLRadixSort* rs;
+    int state;
+    uint n;
+    keytype* sorted;
+    uint* permut;
+    cl_event upload,download;
+  };
+
+  // sort the uploaded batch of a slot and start its download
+  void SortSlot(Slot& slot);
+  // wait the end of the download of a slot
+  void WaitSlot(Slot& slot);
+
+  cl_context Context;
+  cl_command_queue TransferQueue;
+  cl_command_queue ComputeQueue;
+  vector<Slot> slots;
+  vector<uint> h_identity; // initial permutation
+
+};
+
+
+// device primitives on lists of uints of any length (lists of the
+// caller), built with the program of the sort
+// (one object per host thread, as CLRadixSort)
+class CLPrimitives{
+
+public:
+  CLPrimitives(cl_context Context,cl_device_id NumDevice,
+	       cl_command_queue CommandQueue);
+  ~CLPrimitives();
+
+  // scan of d_in[0..n-1] in d_out (d_out can be d_in): exclusive
+  // (d_out[i]=d_in[0]+...+d_in[i-1]) or inclusive (up to d_in[i])
+  // return the sum of the list
+  uint Scan(cl_mem d_in,cl_mem d_out,uint n,bool inclusive=false);
+
+  // histogram of the keys d_keys[0..n-1]: d_histo[b] is the number of
+  // keys equal to b, for b < nbins (the larger keys are ignored;
+  // nothing is done for nbins=0)
+  void Histogram(cl_mem d_keys,uint n,cl_mem d_histo,uint nbins);
+
+  // stream compaction: the values d_in[i] whose flag d_flags[i] is not
+  // zero are copied at the beginning of d_out, in the same order
+  // return the number of copied values
+  uint Compact(cl_mem d_in,cl_mem d_flags,uint n,cl_mem d_out);
 
   // timers
-  float histo_time,scan_time,reorder_time,sort_time,transpose_time;
+  float scan_time,histo_time,compact_time;
+
+  // if not NULL, the commands are recorded in the trace of this
+  // sorter (with TRACE)
+  CLRadixSort* tracer;
+
+private:
+  // scan of one level: the sums of the blocks are scanned recursively
+  uint ScanLevel(cl_mem d_in,cl_mem d_out,uint n,bool inclusive,bool predicate);
+  // launch a kernel and add its duration to the timer
+  void Launch(cl_kernel kernel,const char* name,
+	      size_t nbitems,size_t nblocitems,float* timer);
+  // record a command in the trace
+  void Trace(cl_event eve,const char* name,size_t bytes=0);
+
+  cl_context Context;
+  cl_command_queue CommandQueue;
+  cl_program Program;
+  cl_kernel ckScanBlocks;
+  cl_kernel ckAddBlockSums;
+  cl_kernel ckHistoBins;
+  cl_kernel ckCompactScatter;
+  size_t localMem;
 
 };
 
@@ -11,9 +11,50 @@
 #include <algorithm>
 #include <vector>
 #include <time.h>
+#include <sys/time.h>
 
 
-using namespace std; 
+using namespace std;
+
+// wall clock time in seconds
+static double Now(void){
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec+tv.tv_usec*1e-6;
+}
+
+// lexicographic order of the tuples i and j of three columns
+struct ColumnsLess {
+  const vector<uint>* cols;
+  ColumnsLess(const vector<uint>* c) : cols(c) {}
+  bool operator()(uint i,uint j) const {
+    for(int c=0;c<3;c++){
+      if (cols[c][i] != cols[c][j]) return cols[c][i] < cols[c][j];
+    }
+    return false;
+  }
+};
+
+// order of the records i and j by their key of two bytes at the byte 3
+struct RecordsLess {
+  const vector<unsigned char>* rec;
+  uint stride;
+  bool descending;
+  RecordsLess(const vector<unsigned char>* r,uint s,bool d) :
+    rec(r), stride(s), descending(d) {}
+  uint Key(uint i) const {
+    return (*rec)[i*stride+3] | ((*rec)[i*stride+4] << 8);
+  }
+  bool operator()(uint i,uint j) const {
+    return descending ? Key(i) > Key(j) : Key(i) < Key(j);
+  }
+};
+
+
+// order of the pairs (key,index) by their key only
+static bool KeyLess(const pair<keytype,uint>& a,const pair<keytype,uint>& b){
+  return a.first < b.first;
+}
 
 
 int main(void){
@@ -189,9 +230,9 @@ int main(void){
   assert (status == CL_SUCCESS);
 
   cout << "GPU cache="<<memcache<<endl;
-  cout << "Needed cache="<< _ITEMS*_RADIX*sizeof(int)<<endl;
+  cout << "Needed cache="<< _LOCALSIZE*sizeof(int)<<endl;
 
-  assert(_ITEMS*_RADIX*sizeof(int) < memcache);
+  assert(_LOCALSIZE*sizeof(int) < memcache);
 
   // compute units number
   cl_int cores;
@@ -244,31 +285,71 @@ int main(void){
   //rs.Resize(10);
 
 
-  // cout << rs;
-
-  // cout <<"transpose"<<endl;
-  // rs.Transpose();
-
   // cout << rs;
 
   // assert(1==2);
 
   cout << "sorting "<< rs.nkeys <<" keys"<<endl<<endl;
 
+  uint checksum=rs.KeysChecksum();
+
   rs.Sort();
 
+  // verification on the device
+  bool sorted=rs.DeviceCheck(checksum);
+  cout << "device check: "<<(sorted ? "OK" : "failed")<<" ("<<rs.check_time<<" s)"<<endl;
+  assert(sorted);
+
   rs.RecupGPU();
 
+#ifdef TRACE
+  // timeline of the sort (open it in chrome://tracing)
+  rs.WriteTrace("clradixsort_trace.json");
+#endif
 
   cout << rs.histo_time<<" s in the histograms"<<endl;
   cout << rs.scan_time<<" s in the scanning"<<endl;
   cout << rs.reorder_time<<" s in the reordering"<<endl;
-  cout << rs.transpose_time<<" s in the transposition"<<endl;
 
   cout << rs.sort_time <<" s total GPU time (without memory transfers)"<<endl;
+  cout << rs.devmem_peak <<" Bytes of device memory (peak)"<<endl;
+  cout << CLBufferPool::MemoryPeak(Context) <<" Bytes of shared scratch memory (peak)"<<endl;
   // check the results (debugging)
   rs.Check();
 
+  // radix selection of the median (compared to the sorted list)
+  uint median=rs.Select(rs.nkeys/2);
+  cout << "median="<<median<<" ("<<rs.select_time<<" s)"<<endl;
+  assert(median == rs.h_Keys[rs.nkeys/2]);
+
+  // the k smallest keys (unordered) compared to the sorted list
+  {
+    const uint k=1000;
+    cl_mem d_topKeys=clCreateBuffer(Context,CL_MEM_READ_WRITE,
+				    sizeof(keytype)*k,NULL,&status);
+    assert(status == CL_SUCCESS);
+    cl_mem d_topPermut=clCreateBuffer(Context,CL_MEM_READ_WRITE,
+				      sizeof(uint)*k,NULL,&status);
+    assert(status == CL_SUCCESS);
+    rs.TopK(k,d_topKeys,d_topPermut);
+    vector<keytype> topkeys(k);
+    status = clEnqueueReadBuffer(CommandQueue,d_topKeys,CL_TRUE,0,
+				 sizeof(keytype)*k,&topkeys[0],0,NULL,NULL);
+    assert(status == CL_SUCCESS);
+#ifdef PERMUT
+    vector<uint> topperm(k);
+    status = clEnqueueReadBuffer(CommandQueue,d_topPermut,CL_TRUE,0,
+				 sizeof(uint)*k,&topperm[0],0,NULL,NULL);
+    assert(status == CL_SUCCESS);
+    for(uint i=0;i<k;i++) assert(rs.h_checkKeys[topperm[i]] == topkeys[i]);
+#endif
+    sort(topkeys.begin(),topkeys.end());
+    assert(equal(topkeys.begin(),topkeys.end(),rs.h_Keys));
+    cout << k <<" smallest keys OK"<<endl;
+    clReleaseMemObject(d_topKeys);
+    clReleaseMemObject(d_topPermut);
+  }
+
   // display the data (for debugging)
   if (VERBOSE) {
     //cout << rs;
@@ -287,6 +368,497 @@ int main(void){
 
   cout <<"speedup="<<tcpu/rs.sort_time<<endl;
 
+  // stream of batches: the transfers overlap the sorts
+  {
+    cout << "Stream sorting..."<<endl;
+    const int nbatches=8;
+    const uint batchsize=_N/4;
+    vector<keytype> keys(nbatches*batchsize),sorted(nbatches*batchsize);
+    for(uint i=0;i<keys.size();i++){
+      keys[i]=rand() % ((uint) _MAXINT-1);
+    }
+    CLSortStream stream(Context,Devices[NumDevice]);
+    // (wall time: the overlapped transfers do not use the cpu)
+    double t=Now();
+    for(int b=0;b<nbatches;b++){
+      stream.Push(&keys[b*batchsize],batchsize,&sorted[b*batchsize]);
+    }
+    stream.Flush();
+    cout << stream.ndone <<" batches in "
+	 <<Now()-t<<" s"<<endl;
+    for(int b=0;b<nbatches;b++){
+      assert(is_sorted(sorted.begin()+b*batchsize,
+		       sorted.begin()+(b+1)*batchsize));
+    }
+  }
+
+#ifdef PERMUT
+  // lexicographic sort of three columns of 8, 16 and 20 bits, compared
+  // with a stable sort on the host (the 16 bits column is split between
+  // the two packed keys)
+  {
+    cout << "Columns sorting..."<<endl;
+    const uint n=200000;
+    const int ncols=3;
+    const uint colbits[ncols]={8,16,20};
+    vector<uint> cols[ncols];
+    cl_mem d_cols[ncols];
+    for(int c=0;c<ncols;c++){
+      cols[c].resize(n);
+      for(uint i=0;i<n;i++){
+	// few values in the first column: many ties
+	cols[c][i]= c == 0 ? rand() % 8 : rand() % (1u << colbits[c]);
+      }
+      d_cols[c]=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			       sizeof(uint)*n,&cols[c][0],&status);
+      assert(status == CL_SUCCESS);
+    }
+
+    rs.SortColumns(ncols,d_cols,colbits,n);
+    vector<keytype> keys(n);
+    vector<uint> permut(n);
+    cl_event eve=rs.RecupKeys(0,n,&keys[0],&permut[0]);
+    clWaitForEvents(1,&eve);
+    clReleaseEvent(eve);
+
+    vector<uint> expected(n);
+    for(uint i=0;i<n;i++) expected[i]=i;
+    stable_sort(expected.begin(),expected.end(),ColumnsLess(cols));
+    assert(permut == expected);
+    cout << n <<" tuples of "<<ncols<<" columns in "
+	 <<rs.pack_time<<" s (packing) + "<<rs.sort_time<<" s (last sort)"<<endl;
+
+    for(int c=0;c<ncols;c++) clReleaseMemObject(d_cols[c]);
+  }
+
+  // records of 7 bytes sorted by a key of 2 bytes at the byte 3, in
+  // increasing and decreasing order, compared with a stable sort
+  // on the host
+  {
+    cout << "Records sorting..."<<endl;
+    const uint n=100000;
+    const uint stride=7;
+    vector<unsigned char> rec(n*stride),out(n*stride);
+    for(uint i=0;i<n*stride;i++) rec[i]=rand() % 256;
+    // many ties
+    for(uint i=0;i<n;i++) rec[i*stride+4]=rand() % 4;
+
+    cl_mem d_inRecords=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				      n*stride,&rec[0],&status);
+    assert(status == CL_SUCCESS);
+    cl_mem d_outRecords=clCreateBuffer(Context,CL_MEM_READ_WRITE,
+				       n*stride,NULL,&status);
+    assert(status == CL_SUCCESS);
+
+    for(int desc=0;desc<2;desc++){
+      bool ok=rs.SortRecords(d_inRecords,d_outRecords,n,stride,3,2,desc);
+      assert(ok);
+      status = clEnqueueReadBuffer(CommandQueue,d_outRecords,CL_TRUE,0,
+				   n*stride,&out[0],0,NULL,NULL);
+      assert(status == CL_SUCCESS);
+
+      vector<uint> expected(n);
+      for(uint i=0;i<n;i++) expected[i]=i;
+      stable_sort(expected.begin(),expected.end(),RecordsLess(&rec,stride,desc));
+      for(uint i=0;i<n;i++){
+	assert(equal(&out[i*stride],&out[(i+1)*stride],&rec[expected[i]*stride]));
+      }
+    }
+
+#if _TOTALBITS < 32
+    // keys of 4 bytes larger than _TOTALBITS bits are rejected
+    bool ok=rs.SortRecords(d_inRecords,d_outRecords,n,stride,3,4);
+    assert(!ok);
+#endif
+
+    clReleaseMemObject(d_inRecords);
+    clReleaseMemObject(d_outRecords);
+  }
+#endif
+
+  // merge of a sorted batch B into the sorted list A, with many keys
+  // common to A and B, compared with std::merge (the keys of A first
+  // for equal keys, and the permutation of B shifted by the size of A)
+  {
+    cout << "Merging..."<<endl;
+    const uint na=100000,nb=30000;
+    vector<pair<keytype,uint> > a(na),b(nb),expected(na+nb);
+    for(uint i=0;i<na;i++) a[i]=make_pair((keytype) (rand() % 1000),i);
+    for(uint i=0;i<nb;i++) b[i]=make_pair((keytype) (rand() % 1000),i);
+    stable_sort(a.begin(),a.end(),KeyLess);
+    stable_sort(b.begin(),b.end(),KeyLess);
+    // the indices of B follow those of A after the merge
+    vector<pair<keytype,uint> > bshift=b;
+    for(uint i=0;i<nb;i++) bshift[i].second+=na;
+    merge(a.begin(),a.end(),bshift.begin(),bshift.end(),expected.begin(),KeyLess);
+
+    vector<keytype> akeys(na),bkeys(nb),keys(na+nb);
+    vector<uint> aperm(na),bperm(nb),permut(na+nb);
+    for(uint i=0;i<na;i++){ akeys[i]=a[i].first; aperm[i]=a[i].second; }
+    for(uint i=0;i<nb;i++){ bkeys[i]=b[i].first; bperm[i]=b[i].second; }
+
+    rs.Resize(na);
+#ifdef PERMUT
+    cl_event eve=rs.SendKeys(0,na,&akeys[0],&aperm[0]);
+#else
+    cl_event eve=rs.SendKeys(0,na,&akeys[0]);
+#endif
+    clWaitForEvents(1,&eve);
+    clReleaseEvent(eve);
+
+    cl_mem d_bkeys=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				  sizeof(keytype)*nb,&bkeys[0],&status);
+    assert(status == CL_SUCCESS);
+    cl_mem d_bperm=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				  sizeof(uint)*nb,&bperm[0],&status);
+    assert(status == CL_SUCCESS);
+
+    rs.Merge(d_bkeys,d_bperm,nb);
+    assert(rs.nkeys == na+nb);
+
+#ifdef PERMUT
+    eve=rs.RecupKeys(0,na+nb,&keys[0],&permut[0]);
+#else
+    eve=rs.RecupKeys(0,na+nb,&keys[0]);
+#endif
+    clWaitForEvents(1,&eve);
+    clReleaseEvent(eve);
+    for(uint i=0;i<na+nb;i++){
+      assert(keys[i] == expected[i].first);
+#ifdef PERMUT
+      assert(permut[i] == expected[i].second);
+#endif
+    }
+    cout << na <<" + "<<nb<<" keys merged in "<<rs.merge_time<<" s"<<endl;
+
+    clReleaseMemObject(d_bkeys);
+    clReleaseMemObject(d_bperm);
+  }
+
+  // small sorts (one work group) of 1, 1000 and _SMALLSORT keys with
+  // many ties, compared with a stable sort on the host
+  {
+    cout << "Small sorting..."<<endl;
+    const uint sizes[3]={1,1000,_SMALLSORT};
+    for(int s=0;s<3;s++){
+      const uint n=sizes[s];
+      vector<pair<keytype,uint> > expected(n);
+      vector<keytype> keys(n);
+      vector<uint> permut(n);
+      for(uint i=0;i<n;i++){
+	keys[i]=rand() % 100;
+	permut[i]=i;
+	expected[i]=make_pair(keys[i],i);
+      }
+      stable_sort(expected.begin(),expected.end(),KeyLess);
+
+      rs.Resize(n);
+#ifdef PERMUT
+      cl_event eve=rs.SendKeys(0,n,&keys[0],&permut[0]);
+#else
+      cl_event eve=rs.SendKeys(0,n,&keys[0]);
+#endif
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      // (by SmallSort, unless the device has too little local memory)
+      assert(n <= rs.smallsort || rs.smallsort == 0);
+      rs.Sort();
+#ifdef PERMUT
+      eve=rs.RecupKeys(0,n,&keys[0],&permut[0]);
+#else
+      eve=rs.RecupKeys(0,n,&keys[0]);
+#endif
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      for(uint i=0;i<n;i++){
+	assert(keys[i] == expected[i].first);
+#ifdef PERMUT
+	assert(permut[i] == expected[i].second);
+#endif
+      }
+      cout << "small sort of "<<n<<" keys OK"<<endl;
+    }
+  }
+
+  // primitives: compaction of the odd values of a list (scan of the flags)
+  {
+    cout << "Primitives..."<<endl;
+    const uint n=100000;
+    vector<uint> val(n),flags(n),out(n);
+    uint nodd=0;
+    for(uint i=0;i<n;i++){
+      val[i]=rand();
+      flags[i]=val[i] % 2;
+      nodd+=flags[i];
+    }
+    cl_mem d_val=clCreateBuffer(Context,CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+				sizeof(uint)*n,&val[0],&status);
+    assert(status == CL_SUCCESS);
+    cl_mem d_flags=clCreateBuffer(Context,CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+				  sizeof(uint)*n,&flags[0],&status);
+    assert(status == CL_SUCCESS);
+    cl_mem d_out=clCreateBuffer(Context,CL_MEM_READ_WRITE,sizeof(uint)*n,NULL,&status);
+    assert(status == CL_SUCCESS);
+
+    CLPrimitives prim(Context,Devices[NumDevice],CommandQueue);
+    uint count=prim.Compact(d_val,d_flags,n,d_out);
+    assert(count == nodd);
+    status = clEnqueueReadBuffer(CommandQueue,d_out,CL_TRUE,0,
+				 sizeof(uint)*count,&out[0],0,NULL,NULL);
+    assert(status == CL_SUCCESS);
+    for(uint i=0,k=0;i<n;i++){
+      if (flags[i]) assert(out[k++] == val[i]);
+    }
+    cout << count <<" odd values compacted in "<<prim.compact_time<<" s"<<endl;
+
+    clReleaseMemObject(d_val);
+    clReleaseMemObject(d_flags);
+    clReleaseMemObject(d_out);
+
+    // compaction of more than _N values (a larger list is left in the
+    // pool), then a sort of one pass, whose result is exchanged with a
+    // list of the pool
+    {
+      const uint nbig=_N+_N/2;
+      vector<uint> bval(nbig),bflags(nbig);
+      for(uint i=0;i<nbig;i++){
+	bval[i]=i;
+	bflags[i]=i % 3 == 0;
+      }
+      cl_mem d_bval=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				   sizeof(uint)*nbig,&bval[0],&status);
+      assert(status == CL_SUCCESS);
+      cl_mem d_bflags=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				     sizeof(uint)*nbig,&bflags[0],&status);
+      assert(status == CL_SUCCESS);
+      cl_mem d_bout=clCreateBuffer(Context,CL_MEM_READ_WRITE,sizeof(uint)*nbig,NULL,&status);
+      assert(status == CL_SUCCESS);
+      uint nbigkept=prim.Compact(d_bval,d_bflags,nbig,d_bout);
+      assert(nbigkept == (nbig+2)/3);
+      clReleaseMemObject(d_bval);
+      clReleaseMemObject(d_bflags);
+      clReleaseMemObject(d_bout);
+
+      const uint nsmall=_N/2;
+      vector<keytype> keys(nsmall);
+      for(uint i=0;i<nsmall;i++) keys[i]=rand() % 32;
+      rs.Resize(nsmall);
+      cl_event eve=rs.SendKeys(0,nsmall,&keys[0]);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      rs.Sort(31);
+      assert(rs.npass == 1);
+      eve=rs.RecupKeys(0,nsmall,&keys[0]);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      assert(is_sorted(keys.begin(),keys.end()));
+      cout << "sort of one pass after a compaction of "<<nbig<<" values OK"<<endl;
+    }
+
+    // exclusive and inclusive scans of a list of three levels of
+    // blocks, whose size is not a multiple of _PRIMBLOCK
+    const uint ns=_PRIMBLOCK*_PRIMBLOCK+_PRIMBLOCK/2+7;
+    vector<uint> sval(ns),sout(ns);
+    for(uint i=0;i<ns;i++) sval[i]=rand() % 100;
+    cl_mem d_sval=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				 sizeof(uint)*ns,&sval[0],&status);
+    assert(status == CL_SUCCESS);
+    cl_mem d_sout=clCreateBuffer(Context,CL_MEM_READ_WRITE,sizeof(uint)*ns,NULL,&status);
+    assert(status == CL_SUCCESS);
+    for(int inclusive=0;inclusive<2;inclusive++){
+      uint total=prim.Scan(d_sval,d_sout,ns,inclusive);
+      status = clEnqueueReadBuffer(CommandQueue,d_sout,CL_TRUE,0,
+				   sizeof(uint)*ns,&sout[0],0,NULL,NULL);
+      assert(status == CL_SUCCESS);
+      uint sum=0;
+      for(uint i=0;i<ns;i++){
+	if (inclusive) sum+=sval[i];
+	assert(sout[i] == sum);
+	if (!inclusive) sum+=sval[i];
+      }
+      assert(total == sum);
+    }
+    cout << ns <<" values scanned in "<<prim.scan_time<<" s"<<endl;
+    clReleaseMemObject(d_sval);
+    clReleaseMemObject(d_sout);
+
+    // histograms in local memory and with global atomics
+    // (the keys not smaller than nbins are ignored)
+    const uint nh=200000;
+    const uint nbinsmax=2*_PRIMBINS;
+    vector<uint> hkeys(nh),histo(nbinsmax),hhisto(nbinsmax);
+    for(uint i=0;i<nh;i++) hkeys[i]=rand() % (nbinsmax+100);
+    cl_mem d_hkeys=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				  sizeof(uint)*nh,&hkeys[0],&status);
+    assert(status == CL_SUCCESS);
+    cl_mem d_histo=clCreateBuffer(Context,CL_MEM_READ_WRITE,sizeof(uint)*nbinsmax,NULL,&status);
+    assert(status == CL_SUCCESS);
+    const uint nbins[2]={_PRIMBINS/4,nbinsmax};
+    for(int h=0;h<2;h++){
+      prim.Histogram(d_hkeys,nh,d_histo,nbins[h]);
+      status = clEnqueueReadBuffer(CommandQueue,d_histo,CL_TRUE,0,
+				   sizeof(uint)*nbins[h],&histo[0],0,NULL,NULL);
+      assert(status == CL_SUCCESS);
+      fill(hhisto.begin(),hhisto.end(),0);
+      for(uint i=0;i<nh;i++){
+	if (hkeys[i] < nbins[h]) hhisto[hkeys[i]]++;
+      }
+      assert(equal(histo.begin(),histo.begin()+nbins[h],hhisto.begin()));
+    }
+    prim.Histogram(d_hkeys,nh,d_histo,0);
+    cout << "histograms of "<<nh<<" keys in "<<prim.histo_time<<" s"<<endl;
+    clReleaseMemObject(d_hkeys);
+    clReleaseMemObject(d_histo);
+  }
+
+  // cells keys of particles computed on the device, row-major (with the
+  // cells offsets) and Morton, compared with the keys and the sort on the host
+  {
+    cout << "Cells keys..."<<endl;
+    const uint np=_N/4;
+    const uint nx=50,ny=37;
+    const float dx=1./64,dy=1./32; // (exact inverses)
+    vector<float> x(np),y(np);
+    for(uint j=0;j<np;j++){
+      x[j]=(float) rand()/RAND_MAX;
+      y[j]=(float) rand()/RAND_MAX;
+    }
+    cl_mem d_x=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			      sizeof(float)*np,&x[0],&status);
+    assert(status == CL_SUCCESS);
+    cl_mem d_y=clCreateBuffer(Context,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			      sizeof(float)*np,&y[0],&status);
+    assert(status == CL_SUCCESS);
+
+    for(int morton=0;morton<2;morton++){
+      vector<keytype> keys(np),dev(np),sorted(np);
+      vector<uint> permut(np);
+      uint maxkey=0;
+      for(uint j=0;j<np;j++){
+	uint ix=min((uint) floor(x[j]/dx),nx-1);
+	uint iy=min((uint) floor(y[j]/dy),ny-1);
+	uint key=ix*ny+iy;
+	if (morton) {
+	  key=0;
+	  for(int b=0;b<16;b++){
+	    key |= (((ix >> b) & 1) << (2*b+1)) | (((iy >> b) & 1) << (2*b));
+	  }
+	}
+	keys[j]=key;
+	maxkey=max(maxkey,key);
+      }
+
+      // the cells offsets only for the row-major keys
+      rs.SetCells(0);
+      bool ok=rs.CellKeys(d_x,d_y,np,0,0,dx,dy,nx,ny,morton,!morton);
+      assert(ok);
+      assert(morton || rs.ncells == nx*ny);
+      cl_event eve=rs.RecupKeys(0,np,&dev[0]);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      assert(dev == keys);
+
+      // the first histogram comes from CellKeys
+      rs.Sort(maxkey);
+#ifdef PERMUT
+      eve=rs.RecupKeys(0,np,&sorted[0],&permut[0]);
+#else
+      eve=rs.RecupKeys(0,np,&sorted[0]);
+#endif
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      vector<keytype> hsorted=keys;
+      sort(hsorted.begin(),hsorted.end());
+      assert(sorted == hsorted);
+#ifdef PERMUT
+      for(uint j=0;j<np;j++) assert(keys[permut[j]] == sorted[j]);
+#endif
+
+      if (!morton) {
+	vector<uint> offsets(rs.ncells+1);
+	status = clEnqueueReadBuffer(CommandQueue,rs.d_CellOffsets,CL_TRUE,0,
+				     sizeof(uint)*(rs.ncells+1),&offsets[0],
+				     0,NULL,NULL);
+	assert(status == CL_SUCCESS);
+	assert(offsets[0] == 0 && offsets[rs.ncells] == np);
+	for(uint c=0;c<rs.ncells;c++){
+	  for(uint i=offsets[c];i<offsets[c+1];i++) assert(sorted[i] == c);
+	}
+      }
+      cout << (morton ? "Morton" : "row-major")<<" keys of "<<np
+	   <<" particles OK"<<endl;
+    }
+
+    // fewer cells than the keys: the keys >= ncells are after the
+    // last offset, and all the passes of the keys are done
+    {
+      const uint nc=nx*ny/2;
+      rs.SetCells(nc);
+      bool ok=rs.CellKeys(d_x,d_y,np,0,0,dx,dy,nx,ny);
+      assert(ok);
+      rs.Sort(nx*ny-1);
+      vector<keytype> sorted(np);
+      cl_event eve=rs.RecupKeys(0,np,&sorted[0]);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      assert(is_sorted(sorted.begin(),sorted.end()));
+      vector<uint> offsets(nc+1);
+      status = clEnqueueReadBuffer(CommandQueue,rs.d_CellOffsets,CL_TRUE,0,
+				   sizeof(uint)*(nc+1),&offsets[0],
+				   0,NULL,NULL);
+      assert(status == CL_SUCCESS);
+      for(uint c=0;c<=nc;c++){
+	assert(offsets[c] == (uint) (lower_bound(sorted.begin(),sorted.end(),c)-sorted.begin()));
+      }
+    }
+
+    // the table of the cells offsets of a 1025*1025 Morton grid is
+    // larger than the list
+    rs.SetCells(0);
+    bool ok=rs.CellKeys(d_x,d_y,np,0,0,dx,dy,1025,1025,true,true);
+    assert(ok);
+    assert(rs.ncells > _N);
+    rs.Sort(rs.ncells-1);
+    {
+      vector<uint> offsets(rs.ncells+1);
+      status = clEnqueueReadBuffer(CommandQueue,rs.d_CellOffsets,CL_TRUE,0,
+				   sizeof(uint)*(rs.ncells+1),&offsets[0],
+				   0,NULL,NULL);
+      assert(status == CL_SUCCESS);
+      assert(offsets[0] == 0 && offsets[rs.ncells] == np);
+      assert(is_sorted(offsets.begin(),offsets.end()));
+    }
+    rs.SetCells(0);
+
+    clReleaseMemObject(d_x);
+    clReleaseMemObject(d_y);
+  }
+
+#ifndef SINGLESCRATCH
+  // plan: repeated sorts of lists of the same size
+  {
+    cout << "Sort plan..."<<endl;
+    const int nsorts=10;
+    const uint n=_N/8;
+    vector<keytype> keys(n);
+    CLRadixSortPlan plan(&rs,n);
+    float time=0;
+    for(int s=0;s<nsorts;s++){
+      for(uint i=0;i<n;i++) keys[i]=rand() % ((uint) _MAXINT-1);
+      cl_event eve=rs.SendKeys(0,n,&keys[0]);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      plan.Sort();
+      time+=plan.sort_time;
+      eve=rs.RecupKeys(0,n,&keys[0]);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      assert(is_sorted(keys.begin(),keys.end()));
+    }
+    cout << nsorts <<" sorts of "<<n<<" keys in "<<time<<" s"
+	 <<(plan.commandbuffer ? " (command buffer)" : "")<<endl;
+  }
+#endif
 
   // pic sorting test
   // cout << "PIC sorting test"<<endl;
@@ -12,22 +12,88 @@
 #define _GROUPS 16 // the number of virtual processors is _ITEMS * _GROUPS
 #define  _HISTOSPLIT 512 // number of splits of the histogram
 #define _TOTALBITS 30  // number of bits for the integer in the list (max=32)
+#define _KEYBITS 32 // storage of the keys: 8, 16 or 32 bits (>= _TOTALBITS)
+                    // (narrow keys divide the memory traffic of the passes,
+                    // e.g. _KEYBITS 16 and _TOTALBITS 15 for PICSorting)
 #define _BITS 5  // number of bits in the radix
+                 // (with LOCALATOMIC: _BITS 8 and _TOTALBITS 32, 4 passes)
 // max size of the sorted vector
-// it has to be divisible by  _ITEMS * _GROUPS
+// it has to be divisible by  _ITEMS * _GROUPS (* 4 with VECTORIZE)
 // (for other sizes, pad the list with big values)
 //#define _N (_ITEMS * _GROUPS * 16)  
 #define _N (1<<20)  // maximal size of the list  
-#define VERBOSE 1
-#define TRANSPOSE  // transpose the initial vector (faster memory access)
+#define _SMALLSORT 2048 // the lists of at most _SMALLSORT keys are sorted by one
+                        // work group in local memory (power of two, 0 to disable)
+#ifndef VERBOSE
+#define VERBOSE 1 // (-DVERBOSE=0 for the libraries and tools)
+#endif
+#define TRANSPOSE  // transposed layout between the passes (faster memory access)
 //#define PERMUT  // store the final permutation
+//#define SINGLESCRATCH // with PERMUT: the keys and the permutation share one scratch list
+                        // (3 lists on the device instead of 4, the keys are read twice)
+//#define LOCALATOMIC // one histogram per group computed with local atomics
+                      // (_RADIX ints of local memory instead of _RADIX*_ITEMS:
+                      // bigger radix, fewer passes; no transposition)
+                      // _GROUPS*_RADIX has to be a multiple of 2*_HISTOSPLIT
+//#define VECTORIZE // the work items read four keys at a time (vload4)
+                    // (not with LOCALATOMIC)
+#define SUBGROUPS // scan of the histograms with the subgroup functions on the devices
+                  // with cl_khr_subgroups or cl_intel_subgroups, and with LOCALATOMIC
+                  // ranking of the keys with the ballots of cl_khr_subgroup_ballot
+                  // (the other devices use the usual kernels)
+#define _SUBGROUPMIN 16 // smallest subgroup size of the ballot ranking
+//#define TRACE // record the kernels and transfers for a Chrome trace (WriteTrace)
+#define _TRACEMAX 100000 // largest number of recorded commands between two WriteTrace
+#define _PRIMBLOCK 512 // block of the scans of CLPrimitives (two values per work item)
+#define _PRIMBINS 4096 // largest histogram of CLPrimitives computed in local memory
 ////////////////////////////////////////////////////////
 
 
 // the following parameters are computed from the previous
 #define _RADIX (1 << _BITS) //  radix  = 2^_BITS
 #define _PASS (_TOTALBITS/_BITS) // number of needed passes to sort the list
+#ifdef LOCALATOMIC
+#define _HISTOSIZE (_GROUPS * _RADIX ) // size of the histogram
+// words of the masks of the items of a row of keys (ranking in reorder)
+#define _RANKWORDS ((_ITEMS + 31) / 32)
+#ifdef SUBGROUPS
+// and the counts of the digits of the subgroups (two rows of keys)
+#define _LOCALSIZE (_RADIX * (1 + _RANKWORDS) + 2 * _RADIX * (_ITEMS / _SUBGROUPMIN))
+#else
+// local memory of the kernels (ints): histogram and masks of the digits
+#define _LOCALSIZE (_RADIX * (1 + _RANKWORDS))
+#endif
+#undef TRANSPOSE // the groups read contiguous rows of keys
+#else
 #define _HISTOSIZE (_ITEMS * _GROUPS * _RADIX ) // size of the histogram
-// maximal value of integers for the sort to be correct
-#define _MAXINT (1 << (_TOTALBITS-1))
+#define _LOCALSIZE (_RADIX * _ITEMS) // local memory of the kernels (ints)
+#endif
+#ifdef LOCALATOMIC
+#undef VECTORIZE
+#endif
+// narrow keys: the permutation does not fit in a list of keys
+// and the keys are read one by one
+#if _KEYBITS < 32
+#undef SINGLESCRATCH
+#undef VECTORIZE
+#endif
+#ifdef VECTORIZE
+#define _VECSIZE 4 // number of keys read at a time by a work item
+#else
+#define _VECSIZE 1
+#endif
+// the lists are padded to a multiple of _PADSIZE
+#define _PADSIZE (_ITEMS * _GROUPS * _VECSIZE)
+// maximal value of the random integers of the tests
+#define _MAXINT (1u << (_TOTALBITS-1))
+// largest key (the value of the padding keys)
+#define _KEYMASK (0xFFFFFFFFu >> (32-_TOTALBITS))
+// the histograms are scanned by blocks of 2*_HISTOSPLIT values
+#if (_HISTOSIZE % (2 * _HISTOSPLIT)) != 0
+#error "_HISTOSIZE has to be a multiple of 2*_HISTOSPLIT (with LOCALATOMIC: _GROUPS*_RADIX)"
+#endif
+// the single scratch list is useful only with the permutation
+#ifndef PERMUT
+#undef SINGLESCRATCH
+#endif
 
@@ -0,0 +1,296 @@
+// Python binding of the CLRadixSort class
+// copyright Philippe Helluy, Université de Strasbourg, France, 2011, helluy@math.unistra.fr
+// licensed under the GNU Lesser General Public License see http://www.gnu.org/copyleft/lesser.html
+// if you find this software usefull you can cite the following work in your reports or articles:
+// Philippe HELLUY, A portable implementation of the radix sort algorithm in OpenCL, 2011.
+// http://hal.archives-ouvertes.fr/hal-00596730
+
+// the arrays (numpy arrays or any object with the buffer protocol)
+// are sorted in place: the keys are sent to the device and read back
+// directly from their memory, without intermediate copies
+// the GIL is released during the transfers and the sort, so that
+// several threads can sort at the same time (one Sorter per thread)
+//
+// usage:
+//   import numpy, clradixsort
+//   keys=numpy.random.randint(0,1<<20,100000).astype(numpy.uint32)
+//   clradixsort.sort(keys)
+//   s=clradixsort.Sorter()   # one per thread
+//   s.sort(keys,permut)      # permut: uint32 array (with PERMUT)
+//
+// the kernels sources are read in the directory CLRADIXSORT_DIR
+
+#include <Python.h>
+
+#include "CLRadixSort.hpp"
+
+using namespace std;
+
+// the OpenCL context shared by all the sorters
+static cl_context Context=NULL;
+static cl_device_id Device;
+
+// initial permutation
+static vector<uint> identity;
+
+// create the context on the first device of the last platform
+// (the same choice as the example program)
+static int InitContext(void){
+
+  if (Context != NULL) return 0;
+
+  cl_int status;
+  cl_uint NbPlatforms;
+
+  status = clGetPlatformIDs(0, NULL, &NbPlatforms);
+  if (status != CL_SUCCESS || NbPlatforms == 0) {
+    PyErr_SetString(PyExc_RuntimeError,"no OpenCL platform");
+    return -1;
+  }
+  vector<cl_platform_id> Platforms(NbPlatforms);
+  status = clGetPlatformIDs(NbPlatforms, &Platforms[0], NULL);
+  assert(status == CL_SUCCESS);
+
+  status = clGetDeviceIDs(Platforms[NbPlatforms-1],
+			  CL_DEVICE_TYPE_ALL,
+			  1,
+			  &Device,
+			  NULL);
+  if (status != CL_SUCCESS) {
+    PyErr_SetString(PyExc_RuntimeError,"no OpenCL device");
+    return -1;
+  }
+
+  Context = clCreateContext(0, 1, &Device, NULL, NULL, &status);
+  if (status != CL_SUCCESS) {
+    PyErr_SetString(PyExc_RuntimeError,"cannot create the OpenCL context");
+    return -1;
+  }
+
+  identity.resize(_N);
+  for(uint i=0;i<_N;i++){
+    identity[i]=i;
+  }
+
+  return 0;
+
+}
+
+// the buffer holds unsigned integers of size bytes
+// (struct module format, with an optional byte order or size prefix)
+static bool IsUnsigned(const Py_buffer* buf,size_t size){
+
+  if (buf->itemsize != (Py_ssize_t) size) return false;
+  // no format: unsigned bytes
+  if (buf->format == NULL) return true;
+  const char* f=buf->format;
+  if (*f == '@' || *f == '=' || *f == '<' || *f == '>' || *f == '!') f++;
+  return f[0] != 0 && f[1] == 0 && strchr("BHILQN",f[0]) != NULL;
+
+}
+
+// a sorter: one CLRadixSort object with its own command queue
+typedef struct {
+  PyObject_HEAD
+  CLRadixSort* rs;
+  cl_command_queue queue;
+  PyThread_type_lock lock; // one sort at a time
+} Sorter;
+
+static int Sorter_init(Sorter* self,PyObject* args,PyObject* kwds){
+
+  if (InitContext() < 0) return -1;
+
+  cl_int status;
+  self->queue = clCreateCommandQueue(Context,
+				     Device,
+				     CL_QUEUE_PROFILING_ENABLE,
+				     &status);
+  if (status != CL_SUCCESS) {
+    PyErr_SetString(PyExc_RuntimeError,"cannot create the command queue");
+    return -1;
+  }
+
+  // the program is built once for all the sorters
+  Py_BEGIN_ALLOW_THREADS
+  self->rs=new CLRadixSort(Context,Device,self->queue);
+  Py_END_ALLOW_THREADS
+
+  self->lock=PyThread_allocate_lock();
+
+  return 0;
+
+}
+
+static void Sorter_dealloc(Sorter* self){
+
+  if (self->rs != NULL) {
+    delete self->rs;
+    clReleaseCommandQueue(self->queue);
+    PyThread_free_lock(self->lock);
+  }
+  Py_TYPE(self)->tp_free((PyObject*) self);
+
+}
+
+// sort the keys in place (and the permutation of the keys in permut)
+static PyObject* Sorter_sort(Sorter* self,PyObject* args){
+
+  PyObject *okeys,*opermut=NULL;
+  if (!PyArg_ParseTuple(args,"O|O",&okeys,&opermut)) return NULL;
+
+  Py_buffer keys,permut;
+  if (PyObject_GetBuffer(okeys,&keys,
+			PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+    return NULL;
+  }
+  uint n=keys.len/sizeof(keytype);
+  if (!IsUnsigned(&keys,sizeof(keytype)) || n == 0 || n > _N) {
+    PyBuffer_Release(&keys);
+    PyErr_Format(PyExc_ValueError,
+		 "the keys have to be 1 to %d unsigned integers of %d bytes",
+		 _N,(int) sizeof(keytype));
+    return NULL;
+  }
+
+  uint* h_permut=NULL;
+  if (opermut != NULL && opermut != Py_None) {
+#ifdef PERMUT
+    if (PyObject_GetBuffer(opermut,&permut,
+			   PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+      PyBuffer_Release(&keys);
+      return NULL;
+    }
+    if (!IsUnsigned(&permut,sizeof(uint)) || permut.len != (Py_ssize_t) (n*sizeof(uint))) {
+      PyBuffer_Release(&keys);
+      PyBuffer_Release(&permut);
+      PyErr_SetString(PyExc_ValueError,"the permutation has to be uint32 of the size of the keys");
+      return NULL;
+    }
+    h_permut=(uint*) permut.buf;
+#else
+    PyBuffer_Release(&keys);
+    PyErr_SetString(PyExc_ValueError,"the permutation needs PERMUT in CLRadixSortParam.hpp");
+    return NULL;
+#endif
+  }
+
+  CLRadixSort* rs=self->rs;
+  keytype* h_keys=(keytype*) keys.buf;
+
+  // only the _TOTALBITS low bits are sorted: the larger keys are
+  // rejected (the arrays are not modified then)
+  uint maxkey;
+
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(self->lock,WAIT_LOCK);
+
+  rs->Resize(n);
+  cl_event eve=rs->SendKeys(0,n,h_keys,h_permut ? &identity[0] : NULL);
+  clWaitForEvents(1,&eve);
+  clReleaseEvent(eve);
+
+  maxkey=rs->MaxKey();
+  if (maxkey <= _KEYMASK) {
+    rs->Sort(maxkey);
+
+    eve=rs->RecupKeys(0,n,h_keys,h_permut);
+    clWaitForEvents(1,&eve);
+    clReleaseEvent(eve);
+  }
+
+  PyThread_release_lock(self->lock);
+  Py_END_ALLOW_THREADS
+
+  PyBuffer_Release(&keys);
+  if (h_permut != NULL) PyBuffer_Release(&permut);
+
+  if (maxkey > _KEYMASK) {
+    PyErr_Format(PyExc_ValueError,
+		 "the key %u is larger than %d bits",maxkey,_TOTALBITS);
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+
+}
+
+// GPU time of the sorts of the sorter
+static PyObject* Sorter_sort_time(Sorter* self,void* closure){
+
+  return PyFloat_FromDouble(self->rs->sort_time);
+
+}
+
+static PyMethodDef Sorter_methods[] = {
+  {"sort",(PyCFunction) Sorter_sort,METH_VARARGS,
+   "sort(keys[,permut]): sort the keys in place (and store the sorting permutation in permut)"},
+  {NULL}
+};
+
+static PyGetSetDef Sorter_getset[] = {
+  {(char*) "sort_time",(getter) Sorter_sort_time,NULL,
+   (char*) "GPU time of the sorts (without the transfers)",NULL},
+  {NULL}
+};
+
+static PyTypeObject SorterType = {
+  PyVarObject_HEAD_INIT(NULL,0)
+  "clradixsort.Sorter",
+};
+
+// the sorter of the module function sort
+static Sorter* defaultsorter=NULL;
+
+static PyObject* sort(PyObject* module,PyObject* args){
+
+  if (defaultsorter == NULL) {
+    // (the GIL is released during the creation)
+    Sorter* s=(Sorter*) PyObject_CallObject((PyObject*) &SorterType,NULL);
+    if (s == NULL) return NULL;
+    if (defaultsorter == NULL) defaultsorter=s;
+    else Py_DECREF(s);
+  }
+
+  return Sorter_sort(defaultsorter,args);
+
+}
+
+static PyMethodDef module_methods[] = {
+  {"sort",sort,METH_VARARGS,
+   "sort(keys[,permut]): sort the keys in place with the default sorter"},
+  {NULL}
+};
+
+static PyModuleDef clradixsort_module = {
+  PyModuleDef_HEAD_INIT,
+  "clradixsort",
+  "OpenCL radix sort of integer arrays",
+  -1,
+  module_methods
+};
+
+PyMODINIT_FUNC PyInit_clradixsort(void){
+
+  SorterType.tp_basicsize=sizeof(Sorter);
+  SorterType.tp_flags=Py_TPFLAGS_DEFAULT;
+  SorterType.tp_doc="OpenCL radix sorter (one per thread)";
+  SorterType.tp_new=PyType_GenericNew;
+  SorterType.tp_init=(initproc) Sorter_init;
+  SorterType.tp_dealloc=(destructor) Sorter_dealloc;
+  SorterType.tp_methods=Sorter_methods;
+  SorterType.tp_getset=Sorter_getset;
+
+  if (PyType_Ready(&SorterType) < 0) return NULL;
+
+  PyObject* m=PyModule_Create(&clradixsort_module);
+  if (m == NULL) return NULL;
+
+  Py_INCREF(&SorterType);
+  PyModule_AddObject(m,"Sorter",(PyObject*) &SorterType);
+  PyModule_AddIntConstant(m,"N",_N);
+  PyModule_AddIntConstant(m,"KEYBITS",_KEYBITS);
+
+  return m;
+
+}
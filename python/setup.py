@@ -0,0 +1,22 @@
+# build of the python binding of CLRadixSort:
+#   python setup.py build_ext --inplace
+# and at run time, the kernels are read in the directory CLRADIXSORT_DIR:
+#   CLRADIXSORT_DIR=.. python -c "import clradixsort"
+import sys
+from setuptools import setup, Extension
+
+if sys.platform == 'darwin':
+    extra_link_args = ['-framework', 'OpenCL']
+    libraries = ['pthread']
+else:
+    extra_link_args = []
+    libraries = ['OpenCL', 'pthread']
+
+setup(name='clradixsort',
+      ext_modules=[Extension('clradixsort',
+                             ['clradixsort.cpp', '../CLRadixSort.cpp'],
+                             include_dirs=['..'],
+                             # no messages of the sorts on stdout
+                             define_macros=[('VERBOSE', '0')],
+                             libraries=libraries,
+                             extra_link_args=extra_link_args)])
@@ -0,0 +1,101 @@
+// client of the sort daemon clsortd
+// copyright Philippe Helluy, Université de Strasbourg, France, 2011, helluy@math.unistra.fr
+// licensed under the GNU Lesser General Public License see http://www.gnu.org/copyleft/lesser.html
+// if you find this software usefull you can cite the following work in your reports or articles:
+// Philippe HELLUY, A portable implementation of the radix sort algorithm in OpenCL, 2011.
+// http://hal.archives-ouvertes.fr/hal-00596730
+
+#include "clsortclient.hpp"
+
+#include <iostream>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+// connect to the daemon and give it the shared memory
+CLSortClient::CLSortClient(const char* path){
+
+  sock=socket(AF_UNIX,SOCK_STREAM,0);
+  assert(sock >= 0);
+
+  struct sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+  if (connect(sock,(struct sockaddr*) &addr,sizeof(addr)) != 0) {
+    perror(path);
+    assert(false && "the sort daemon is not running");
+  }
+
+  // the size is sealed: the daemon refuses a memory that could shrink
+  shm=memfd_create("clsort",MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  assert(shm >= 0);
+  int err=ftruncate(shm,_CLSORT_SHMSIZE);
+  assert(err == 0);
+  err=fcntl(shm,F_ADD_SEALS,F_SEAL_SHRINK | F_SEAL_GROW);
+  assert(err == 0);
+  map=mmap(NULL,_CLSORT_SHMSIZE,PROT_READ | PROT_WRITE,MAP_SHARED,shm,0);
+  assert(map != MAP_FAILED);
+  keys=(keytype*) map;
+  permut=(unsigned int*) (keys+_N);
+
+  // the descriptor of the shared memory is sent with one byte
+  char c=0;
+  struct iovec iov;
+  iov.iov_base=&c;
+  iov.iov_len=1;
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control,0,sizeof(control));
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  msg.msg_control=control;
+  msg.msg_controllen=sizeof(control);
+  struct cmsghdr* cmsg=CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level=SOL_SOCKET;
+  cmsg->cmsg_type=SCM_RIGHTS;
+  cmsg->cmsg_len=CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg),&shm,sizeof(int));
+  ssize_t len=sendmsg(sock,&msg,0);
+  assert(len == 1);
+
+  sort_time=0;
+
+}
+
+CLSortClient::~CLSortClient(){
+
+  close(sock);
+  munmap(map,_CLSORT_SHMSIZE);
+  close(shm);
+
+}
+
+// send a request and wait for the answer
+bool CLSortClient::Sort(unsigned int n,bool withpermut,int priority){
+
+  if (n == 0) return true;
+  if (n > _N) return false;
+
+  CLSortRequest req;
+  req.n=n;
+  req.priority=priority;
+  req.permut=withpermut;
+  if (send(sock,&req,sizeof(req),0) != sizeof(req)) return false;
+
+  CLSortReply rep;
+  if (recv(sock,&rep,sizeof(rep),MSG_WAITALL) != sizeof(rep)) return false;
+
+  sort_time=rep.time;
+
+  return rep.status == 0;
+
+}
@@ -0,0 +1,77 @@
+// client of the sort daemon clsortd
+// copyright Philippe Helluy, Université de Strasbourg, France, 2011, helluy@math.unistra.fr
+// licensed under the GNU Lesser General Public License see http://www.gnu.org/copyleft/lesser.html
+// if you find this software usefull you can cite the following work in your reports or articles:
+// Philippe HELLUY, A portable implementation of the radix sort algorithm in OpenCL, 2011.
+// http://hal.archives-ouvertes.fr/hal-00596730
+
+// the daemon owns the OpenCL context, the program and the lists on
+// the device; the clients send their keys in a shared memory
+// (one memfd per client, sealed against shrinking and passed once at
+// the connection) and the requests on a Unix-domain socket
+//
+// usage:
+//   CLSortClient c;
+//   for(i...) c.keys[i]=...;
+//   c.Sort(n);          // the n first keys of c.keys are sorted in place
+
+#ifndef _CLSORTCLIENT_HPP
+#define _CLSORTCLIENT_HPP
+
+#include "CLRadixSortParam.hpp"
+
+#if _KEYBITS == 8
+typedef unsigned char keytype;
+#elif _KEYBITS == 16
+typedef unsigned short keytype;
+#else
+typedef unsigned int keytype;
+#endif
+
+// socket of the daemon
+#define _CLSORTD_PATH "/tmp/clsortd.sock"
+
+// size of the shared memory of a client: _N keys and _N indices
+#define _CLSORT_SHMSIZE (_N * (sizeof(keytype) + sizeof(unsigned int)))
+
+// a request: sort the n first keys (and compute the permutation)
+// the jobs of higher priority are sorted first
+struct CLSortRequest {
+  unsigned int n;
+  int priority;
+  int permut;
+};
+
+// the answer of the daemon (status 0 if the keys are sorted)
+struct CLSortReply {
+  int status;
+  float time; // time of the batch of the job in the daemon (s)
+};
+
+class CLSortClient {
+
+ public:
+
+  // connect to the daemon
+  CLSortClient(const char* path=_CLSORTD_PATH);
+  ~CLSortClient();
+
+  // sort the keys 0..n-1 (n <= _N) and if permut, store the
+  // sorting permutation in permut[0..n-1] (needs PERMUT in the daemon)
+  // the keys have to fit in _TOTALBITS bits
+  // return false in case of error
+  bool Sort(unsigned int n,bool permut=false,int priority=0);
+
+  keytype* keys;       // the keys in shared memory
+  unsigned int* permut; // the permutation in shared memory
+  float sort_time;     // time of the last sort in the daemon
+
+ private:
+
+  int sock;            // connection to the daemon
+  int shm;             // shared memory
+  void* map;
+
+};
+
+#endif
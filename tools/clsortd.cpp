@@ -0,0 +1,366 @@
+// sort daemon: one CLRadixSort shared by several client processes
+// copyright Philippe Helluy, Université de Strasbourg, France, 2011, helluy@math.unistra.fr
+// licensed under the GNU Lesser General Public License see http://www.gnu.org/copyleft/lesser.html
+// if you find this software usefull you can cite the following work in your reports or articles:
+// Philippe HELLUY, A portable implementation of the radix sort algorithm in OpenCL, 2011.
+// http://hal.archives-ouvertes.fr/hal-00596730
+
+// usage: clsortd [socket]   (default _CLSORTD_PATH)
+//
+// the daemon owns the context, the program and the lists on the device
+// and the clients (see clsortclient.hpp) send requests on a Unix-domain
+// socket, the keys being in a shared memory of the client
+// the requests that arrive while the device is busy are queued; then:
+// - a job of more than _SMALLJOB keys is sorted alone, by priority
+//   (the oldest first for equal priorities)
+// - the small jobs are sorted together in one batch: the number of the
+//   job is put above the bits of the keys (the list is sorted by
+//   segments) if these bits fit in _TOTALBITS
+
+#include "CLRadixSort.hpp"
+#include "clsortclient.hpp"
+
+#include <list>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define _SMALLJOB (_N / 16) // largest job sorted in a batch
+
+using namespace std;
+
+// a client process
+struct Client {
+  int sock;
+  keytype* keys;        // shared memory of the client (NULL until received)
+  uint* permut;
+};
+
+// a queued sort request
+struct Job {
+  Client* client;
+  CLSortRequest req;
+  uint maxkey;          // largest key of the job
+  unsigned long seq;    // arrival number
+};
+
+// wall clock time in seconds
+static double Now(void){
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec+tv.tv_usec*1e-6;
+}
+
+// number of bits of v
+static int Bits(uint v){
+  int b=0;
+  while(v >> b) b++;
+  return b;
+}
+
+// accept a client (its shared memory comes later, see Receive)
+static Client* Accept(int server){
+
+  int sock=accept(server,NULL,NULL);
+  if (sock < 0) return NULL;
+
+  Client* cl=new Client;
+  cl->sock=sock;
+  cl->keys=NULL;
+  cl->permut=NULL;
+
+  return cl;
+
+}
+
+// receive the shared memory of a client (the socket is readable)
+// the memory has to be sealed against shrinking and large enough,
+// else a read of the keys would kill the daemon (SIGBUS)
+static bool Receive(Client* cl){
+
+  char c;
+  struct iovec iov;
+  iov.iov_base=&c;
+  iov.iov_len=1;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  msg.msg_control=control;
+  msg.msg_controllen=sizeof(control);
+  struct cmsghdr* cmsg;
+  if (recvmsg(cl->sock,&msg,MSG_DONTWAIT) != 1 ||
+      (cmsg=CMSG_FIRSTHDR(&msg)) == NULL ||
+      cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+    return false;
+  }
+  int shm;
+  memcpy(&shm,CMSG_DATA(cmsg),sizeof(int));
+
+  struct stat st;
+  int seals=fcntl(shm,F_GET_SEALS);
+  if (seals < 0 || !(seals & F_SEAL_SHRINK) ||
+      fstat(shm,&st) != 0 || st.st_size < (off_t) _CLSORT_SHMSIZE) {
+    close(shm);
+    return false;
+  }
+
+  void* map=mmap(NULL,_CLSORT_SHMSIZE,PROT_READ | PROT_WRITE,MAP_SHARED,shm,0);
+  close(shm);
+  if (map == MAP_FAILED) return false;
+
+  cl->keys=(keytype*) map;
+  cl->permut=(uint*) (cl->keys+_N);
+
+  return true;
+
+}
+
+static void Disconnect(Client* cl){
+
+  close(cl->sock);
+  if (cl->keys != NULL) munmap(cl->keys,_CLSORT_SHMSIZE);
+  delete cl;
+
+}
+
+static void Reply(Client* cl,int status,float time){
+
+  CLSortReply rep;
+  rep.status=status;
+  rep.time=time;
+  send(cl->sock,&rep,sizeof(rep),MSG_NOSIGNAL);
+
+}
+
+int main(int argc,char* argv[]){
+
+  const char* path= argc > 1 ? argv[1] : _CLSORTD_PATH;
+
+  // OpenCL initializations: first device of the last platform
+  cl_int status;
+  cl_uint NbPlatforms;
+  status = clGetPlatformIDs(0, NULL, &NbPlatforms);
+  assert(status == CL_SUCCESS && NbPlatforms > 0);
+  vector<cl_platform_id> Platforms(NbPlatforms);
+  status = clGetPlatformIDs(NbPlatforms, &Platforms[0], NULL);
+  assert(status == CL_SUCCESS);
+  cl_device_id Device;
+  status = clGetDeviceIDs(Platforms[NbPlatforms-1], CL_DEVICE_TYPE_ALL,
+			  1, &Device, NULL);
+  assert(status == CL_SUCCESS);
+  cl_context Context = clCreateContext(0, 1, &Device, NULL, NULL, &status);
+  assert(status == CL_SUCCESS);
+  cl_command_queue CommandQueue = clCreateCommandQueue(Context, Device,
+						       CL_QUEUE_PROFILING_ENABLE,
+						       &status);
+  assert(status == CL_SUCCESS);
+
+  // the only sorter: one program build and one set of lists
+  CLRadixSort rs(Context,Device,CommandQueue);
+
+  // initial permutation and lists of the batches
+  vector<uint> identity(_N);
+  for(uint i=0;i<_N;i++) identity[i]=i;
+  vector<keytype> batchKeys(_N);
+  vector<uint> batchPermut(_N);
+
+  // socket of the daemon
+  int server=socket(AF_UNIX,SOCK_STREAM,0);
+  assert(server >= 0);
+  struct sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+  unlink(path);
+  if (bind(server,(struct sockaddr*) &addr,sizeof(addr)) != 0 ||
+      listen(server,16) != 0) {
+    perror(path);
+    return 1;
+  }
+  cout << "clsortd listening on "<<path<<endl;
+
+  list<Client*> clients;
+  list<Job> pending;
+  unsigned long seq=0;
+
+  while(true){
+
+    // wait for requests (only check the sockets if jobs are pending)
+    vector<struct pollfd> fds(1+clients.size());
+    fds[0].fd=server;
+    fds[0].events=POLLIN;
+    int i=1;
+    for(list<Client*>::iterator c=clients.begin();c != clients.end();c++,i++){
+      fds[i].fd=(*c)->sock;
+      fds[i].events=POLLIN;
+    }
+    if (poll(&fds[0],fds.size(),pending.empty() ? -1 : 0) < 0) continue;
+
+    i=1;
+    for(list<Client*>::iterator c=clients.begin();c != clients.end();i++){
+      Client* cl=*c;
+      if (fds[i].revents == 0) {
+	c++;
+	continue;
+      }
+      // first message: the shared memory
+      if (cl->keys == NULL) {
+	if (Receive(cl)) c++;
+	else {
+	  Disconnect(cl);
+	  c=clients.erase(c);
+	}
+	continue;
+      }
+      // (no wait for an incomplete request: the loop is shared)
+      Job job;
+      ssize_t len=recv(cl->sock,&job.req,sizeof(job.req),MSG_DONTWAIT);
+      if (len < 0 && errno == EAGAIN) {
+	c++;
+	continue;
+      }
+      if (len != sizeof(job.req)) {
+	// disconnection: forget the jobs of the client
+	for(list<Job>::iterator j=pending.begin();j != pending.end();){
+	  if (j->client == cl) j=pending.erase(j);
+	  else j++;
+	}
+	Disconnect(cl);
+	c=clients.erase(c);
+	continue;
+      }
+      c++;
+      job.client=cl;
+      job.seq=seq++;
+      // check the request
+      bool ok= job.req.n > 0 && job.req.n <= _N;
+#ifndef PERMUT
+      ok = ok && !job.req.permut;
+#endif
+      job.maxkey=0;
+      for(uint k=0;ok && k<job.req.n;k++){
+	job.maxkey=max(job.maxkey,(uint) cl->keys[k]);
+      }
+      if (!ok || job.maxkey > _KEYMASK) {
+	Reply(cl,-1,0);
+	continue;
+      }
+      pending.push_back(job);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      Client* cl=Accept(server);
+      if (cl != NULL) clients.push_back(cl);
+    }
+
+    if (pending.empty()) continue;
+
+    // the job of highest priority (the oldest first)
+    list<Job>::iterator best=pending.begin();
+    for(list<Job>::iterator j=pending.begin();j != pending.end();j++){
+      if (j->req.priority > best->req.priority ||
+	  (j->req.priority == best->req.priority && j->seq < best->seq)) best=j;
+    }
+
+    double t=Now();
+
+    if (best->req.n > _SMALLJOB) {
+      // large job: sorted alone
+      Job job=*best;
+      pending.erase(best);
+      Client* cl=job.client;
+      uint n=job.req.n;
+      uint* permut= job.req.permut ? cl->permut : NULL;
+      rs.Resize(n);
+      cl_event eve=rs.SendKeys(0,n,cl->keys,permut ? &identity[0] : NULL);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      rs.Sort(job.maxkey);
+      eve=rs.RecupKeys(0,n,cl->keys,permut);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      Reply(cl,0,Now()-t);
+      if (VERBOSE) {
+	cout << "job of "<<n<<" keys, priority "<<job.req.priority<<endl;
+      }
+      continue;
+    }
+
+    // batch of small jobs, by order of priority: the job j of the
+    // batch is the segment j of the list, its keys have keybits bits
+    vector<Job> batch;
+    int keybits=0;
+    uint total=0;
+    bool withpermut=false;
+    while(true){
+      list<Job>::iterator next=pending.end();
+      for(list<Job>::iterator j=pending.begin();j != pending.end();j++){
+	if (j->req.n > _SMALLJOB) continue;
+	if (next == pending.end() || j->req.priority > next->req.priority ||
+	    (j->req.priority == next->req.priority && j->seq < next->seq)) next=j;
+      }
+      if (next == pending.end()) break;
+      int kb=max(keybits,Bits(next->maxkey));
+      if (total+next->req.n > _N || kb+Bits(batch.size()) > _TOTALBITS) break;
+      keybits=kb;
+      total+=next->req.n;
+      withpermut = withpermut || next->req.permut;
+      batch.push_back(*next);
+      pending.erase(next);
+    }
+
+    uint mask= keybits > 0 ? (0xFFFFFFFFu >> (32-keybits)) : 0;
+    uint first=0;
+    for(uint j=0;j<batch.size();j++){
+      keytype* keys=batch[j].client->keys;
+      for(uint k=0;k<batch[j].req.n;k++){
+	batchKeys[first+k]=(j << keybits) | keys[k];
+      }
+      first+=batch[j].req.n;
+    }
+
+    rs.Resize(total);
+    cl_event eve=rs.SendKeys(0,total,&batchKeys[0],withpermut ? &identity[0] : NULL);
+    clWaitForEvents(1,&eve);
+    clReleaseEvent(eve);
+    rs.Sort(((batch.size()-1) << keybits) | mask);
+    eve=rs.RecupKeys(0,total,&batchKeys[0],withpermut ? &batchPermut[0] : NULL);
+    clWaitForEvents(1,&eve);
+    clReleaseEvent(eve);
+
+    // the segments are in the order of the jobs
+    float time=Now()-t;
+    first=0;
+    for(uint j=0;j<batch.size();j++){
+      Client* cl=batch[j].client;
+      for(uint k=0;k<batch[j].req.n;k++){
+	cl->keys[k]=batchKeys[first+k] & mask;
+      }
+      if (batch[j].req.permut) {
+	for(uint k=0;k<batch[j].req.n;k++){
+	  cl->permut[k]=batchPermut[first+k]-first;
+	}
+      }
+      first+=batch[j].req.n;
+      Reply(cl,0,time);
+    }
+    if (VERBOSE) {
+      cout << "batch of "<<batch.size()<<" jobs, "<<total<<" keys"<<endl;
+    }
+
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,279 @@
+// sort of a binary file with the CLRadixSort class
+// copyright Philippe Helluy, Université de Strasbourg, France, 2011, helluy@math.unistra.fr
+// licensed under the GNU Lesser General Public License see http://www.gnu.org/copyleft/lesser.html
+// if you find this software usefull you can cite the following work in your reports or articles:
+// Philippe HELLUY, A portable implementation of the radix sort algorithm in OpenCL, 2011.
+// http://hal.archives-ouvertes.fr/hal-00596730
+
+// usage: clsortfile [-s stride] [-k keyoffset] input output
+//
+// the input file is a raw list of uint32 keys (native endianness), or
+// with -s a list of records of stride bytes, each with a uint32 key at
+// the byte keyoffset (needs PERMUT)
+// the keys have to fit in _TOTALBITS bits
+//
+// the input is mapped in memory and sorted on the device by chunks of
+// _N keys (records); the sorted chunks are merged on the host into the
+// output file, which is also mapped in memory
+// the read (first touch of the input), sort (transfers and device),
+// merge and write (flush of the output) throughputs are reported
+// separately (build with -DVERBOSE=0, as in SConstruct, so that the
+// messages of the sorts are not mixed with the report)
+
+#include "CLRadixSort.hpp"
+
+#include <queue>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+using namespace std;
+
+// wall clock time in seconds
+static double Now(void){
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec+tv.tv_usec*1e-6;
+}
+
+// key of the record i
+static inline uint Key(const unsigned char* base,size_t i,
+		       uint stride,uint keyoffset){
+  uint key;
+  memcpy(&key,base+i*stride+keyoffset,sizeof(uint));
+  return key;
+}
+
+// map a file in memory
+static unsigned char* Map(int fd,size_t size,bool write){
+  void* p=mmap(NULL,size,write ? PROT_READ | PROT_WRITE : PROT_READ,
+	       MAP_SHARED,fd,0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return (unsigned char*) p;
+}
+
+int main(int argc,char* argv[]){
+
+  uint stride=0;  // 0: file of keys
+  uint keyoffset=0;
+
+  int opt;
+  while((opt=getopt(argc,argv,"s:k:")) != -1){
+    switch(opt){
+    case 's': stride=atoi(optarg); break;
+    case 'k': keyoffset=atoi(optarg); break;
+    default:
+      cerr << "usage: "<<argv[0]<<" [-s stride] [-k keyoffset] input output"<<endl;
+      return 1;
+    }
+  }
+  if (argc-optind != 2) {
+    cerr << "usage: "<<argv[0]<<" [-s stride] [-k keyoffset] input output"<<endl;
+    return 1;
+  }
+
+  bool records= (stride > 0);
+  if (!records) {
+    stride=sizeof(uint);
+    // the keys are sent to the device directly from the file
+    if (sizeof(keytype) != sizeof(uint)) {
+      cerr << "a file of keys needs _KEYBITS 32"<<endl;
+      return 1;
+    }
+  }
+  else {
+#ifndef PERMUT
+    cerr << "the sort of records needs PERMUT"<<endl;
+    return 1;
+#endif
+    if (keyoffset+sizeof(uint) > stride) {
+      cerr << "the key is not in the record"<<endl;
+      return 1;
+    }
+  }
+
+  // input and output files
+  int fin=open(argv[optind],O_RDONLY);
+  if (fin < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  struct stat st;
+  fstat(fin,&st);
+  size_t size=st.st_size;
+  if (size == 0 || size % stride != 0) {
+    cerr << "the size of the file is not a multiple of "<<stride<<endl;
+    return 1;
+  }
+  size_t n=size/stride;
+
+  int fout=open(argv[optind+1],O_RDWR | O_CREAT | O_TRUNC,0644);
+  if (fout < 0 || ftruncate(fout,size) != 0) {
+    perror(argv[optind+1]);
+    return 1;
+  }
+
+  const unsigned char* in=Map(fin,size,false);
+  unsigned char* out=Map(fout,size,true);
+  madvise((void*) in,size,MADV_SEQUENTIAL);
+
+  // the sorted chunks go directly to the output if there is
+  // only one, else to a temporary file before the merge
+  size_t nchunks=(n+_N-1)/_N;
+  unsigned char* runs=out;
+  int ftmp=-1;
+  if (nchunks > 1) {
+    string tmpname=string(argv[optind+1])+".runs";
+    ftmp=open(tmpname.c_str(),O_RDWR | O_CREAT | O_TRUNC,0600);
+    if (ftmp < 0 || ftruncate(ftmp,size) != 0) {
+      perror(tmpname.c_str());
+      return 1;
+    }
+    unlink(tmpname.c_str());
+    runs=Map(ftmp,size,true);
+  }
+
+  // OpenCL initializations: first device of the last platform
+  cl_int status;
+  cl_uint NbPlatforms;
+  status = clGetPlatformIDs(0, NULL, &NbPlatforms);
+  assert(status == CL_SUCCESS && NbPlatforms > 0);
+  vector<cl_platform_id> Platforms(NbPlatforms);
+  status = clGetPlatformIDs(NbPlatforms, &Platforms[0], NULL);
+  assert(status == CL_SUCCESS);
+  cl_device_id Device;
+  status = clGetDeviceIDs(Platforms[NbPlatforms-1], CL_DEVICE_TYPE_ALL,
+			  1, &Device, NULL);
+  assert(status == CL_SUCCESS);
+  cl_context Context = clCreateContext(0, 1, &Device, NULL, NULL, &status);
+  assert(status == CL_SUCCESS);
+  cl_command_queue CommandQueue = clCreateCommandQueue(Context, Device,
+						       CL_QUEUE_PROFILING_ENABLE,
+						       &status);
+  assert(status == CL_SUCCESS);
+
+  CLRadixSort* rs=new CLRadixSort(Context,Device,CommandQueue);
+
+  // device lists of records
+  cl_mem d_inRecords=NULL,d_outRecords=NULL;
+  if (records) {
+    d_inRecords=clCreateBuffer(Context,CL_MEM_READ_ONLY,
+			       (size_t) stride*_N,NULL,&status);
+    assert(status == CL_SUCCESS);
+    d_outRecords=clCreateBuffer(Context,CL_MEM_WRITE_ONLY,
+				(size_t) stride*_N,NULL,&status);
+    assert(status == CL_SUCCESS);
+  }
+
+  double read_time=0,sort_time=0,merge_time=0,write_time=0;
+  double t;
+
+  for(size_t c=0;c<nchunks;c++){
+    size_t first=c*_N;
+    uint nc=min((size_t) _N,n-first);
+    const unsigned char* src=in+first*stride;
+    unsigned char* dest=runs+first*stride;
+
+    // read: first touch of the chunk, and check of the keys
+    // (the records keys are checked on the device)
+    t=Now();
+    uint maxkey=0;
+    for(uint i=0;i<nc && !records;i++){
+      maxkey=max(maxkey,Key(src,i,stride,keyoffset));
+    }
+    read_time+=Now()-t;
+    if (maxkey > _KEYMASK) {
+      cerr << "key "<<maxkey<<" larger than "<<_TOTALBITS<<" bits"<<endl;
+      return 1;
+    }
+
+    // sort on the device
+    t=Now();
+    if (!records) {
+      rs->Resize(nc);
+      cl_event eve=rs->SendKeys(0,nc,(const keytype*) src);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+      rs->Sort(maxkey);
+      eve=rs->RecupKeys(0,nc,(keytype*) dest);
+      clWaitForEvents(1,&eve);
+      clReleaseEvent(eve);
+    }
+#ifdef PERMUT
+    else {
+      status = clEnqueueWriteBuffer(CommandQueue,d_inRecords,CL_TRUE,0,
+				    (size_t) stride*nc,src,0,NULL,NULL);
+      assert(status == CL_SUCCESS);
+      if (!rs->SortRecords(d_inRecords,d_outRecords,nc,stride,keyoffset,sizeof(uint))) return 1;
+      status = clEnqueueReadBuffer(CommandQueue,d_outRecords,CL_TRUE,0,
+				   (size_t) stride*nc,dest,0,NULL,NULL);
+      assert(status == CL_SUCCESS);
+    }
+#endif
+    sort_time+=Now()-t;
+  }
+
+  // merge of the sorted chunks (k-way merge with a heap;
+  // for equal keys the first chunk comes first)
+  if (nchunks > 1) {
+    t=Now();
+    typedef pair<uint,size_t> Head; // key, chunk
+    priority_queue<Head,vector<Head>,greater<Head> > heap;
+    vector<size_t> pos(nchunks),end(nchunks);
+    for(size_t c=0;c<nchunks;c++){
+      pos[c]=c*_N;
+      end[c]=min(n,(c+1)*_N);
+      heap.push(Head(Key(runs,pos[c],stride,keyoffset),c));
+    }
+    for(size_t i=0;i<n;i++){
+      size_t c=heap.top().second;
+      heap.pop();
+      memcpy(out+i*stride,runs+pos[c]*stride,stride);
+      pos[c]++;
+      if (pos[c] < end[c]) heap.push(Head(Key(runs,pos[c],stride,keyoffset),c));
+    }
+    merge_time=Now()-t;
+  }
+
+  // write: flush of the output
+  t=Now();
+  msync(out,size,MS_SYNC);
+  write_time=Now()-t;
+
+  double mb=size/1e6;
+  cout << n <<" "<<(records ? "records" : "keys")<<" ("<<mb<<" MB) in "
+       <<nchunks<<" chunks"<<endl;
+  cout << "read:  "<<read_time<<" s, "<<mb/read_time<<" MB/s"<<endl;
+  cout << "sort:  "<<sort_time<<" s, "<<mb/sort_time<<" MB/s (device: "
+       <<rs->sort_time<<" s)"<<endl;
+  if (nchunks > 1) {
+    cout << "merge: "<<merge_time<<" s, "<<mb/merge_time<<" MB/s"<<endl;
+  }
+  cout << "write: "<<write_time<<" s, "<<mb/write_time<<" MB/s"<<endl;
+
+  delete rs;
+  if (records) {
+    clReleaseMemObject(d_inRecords);
+    clReleaseMemObject(d_outRecords);
+  }
+  clReleaseCommandQueue(CommandQueue);
+  clReleaseContext(Context);
+
+  munmap((void*) in,size);
+  munmap(out,size);
+  if (ftmp >= 0) {
+    munmap(runs,size);
+    close(ftmp);
+  }
+  close(fin);
+  close(fout);
+
+  return 0;
+
+}
@@ -0,0 +1,106 @@
+// check of the sort daemon clsortd with concurrent clients
+// copyright Philippe Helluy, Université de Strasbourg, France, 2011, helluy@math.unistra.fr
+// licensed under the GNU Lesser General Public License see http://www.gnu.org/copyleft/lesser.html
+// if you find this software usefull you can cite the following work in your reports or articles:
+// Philippe HELLUY, A portable implementation of the radix sort algorithm in OpenCL, 2011.
+// http://hal.archives-ouvertes.fr/hal-00596730
+
+// usage: clsorttest [nclients] [socket]   (the daemon has to be running)
+//
+// nclients processes send at the same time small jobs (sorted together
+// in batches by the daemon) and large ones (sorted alone); each client
+// checks its sorted keys and, with PERMUT, the permutation (which has
+// to be rebased on the job after the split of a batch)
+
+#include "clsortclient.hpp"
+
+#include <iostream>
+#include <vector>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// jobs of a client, return the number of errors
+static int Client(int id,const char* path){
+
+  CLSortClient c(path);
+  srand(id+1);
+
+  // sizes of the jobs: small ones (batches) and one of _N/2 keys
+  const unsigned int sizes[]={1,100,1000,_N/64,_N/32,_N/2,5000,_N/20};
+  const int nsizes=sizeof(sizes)/sizeof(sizes[0]);
+
+  // the keys leave room in _TOTALBITS for the number of the jobs
+  // of a batch
+  unsigned int maxkey=1u << (_TOTALBITS-8);
+  if (maxkey > (unsigned int) (keytype) -1) maxkey=(keytype) -1;
+
+  int errors=0;
+  for(int s=0;s<nsizes;s++){
+    unsigned int n=sizes[s];
+    vector<keytype> keys(n);
+    for(unsigned int i=0;i<n;i++){
+      keys[i]=rand() % maxkey;
+      c.keys[i]=keys[i];
+    }
+#ifdef PERMUT
+    bool withpermut=true;
+#else
+    bool withpermut=false;
+#endif
+    if (!c.Sort(n,withpermut,s % 2)) {
+      cerr << "client "<<id<<": request of "<<n<<" keys refused"<<endl;
+      errors++;
+      continue;
+    }
+    vector<bool> seen(n,false);
+    for(unsigned int i=0;i<n;i++){
+      bool ok= (i == 0 || c.keys[i-1] <= c.keys[i]);
+      if (withpermut) {
+	unsigned int p=c.permut[i];
+	ok = ok && p < n && !seen[p] && keys[p] == c.keys[i];
+	if (p < n) seen[p]=true;
+      }
+      if (!ok) {
+	cerr << "client "<<id<<": job of "<<n<<" keys wrong at "<<i<<endl;
+	errors++;
+	break;
+      }
+    }
+  }
+
+  return errors;
+
+}
+
+int main(int argc,char* argv[]){
+
+  int nclients= argc > 1 ? atoi(argv[1]) : 4;
+  const char* path= argc > 2 ? argv[2] : _CLSORTD_PATH;
+
+  // one process per client
+  for(int id=0;id<nclients;id++){
+    pid_t pid=fork();
+    assert(pid >= 0);
+    if (pid == 0) return Client(id,path) == 0 ? 0 : 1;
+  }
+
+  int failed=0;
+  for(int id=0;id<nclients;id++){
+    int status;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+  }
+
+  if (failed > 0) {
+    cout << failed <<" of "<<nclients<<" clients failed"<<endl;
+    return 1;
+  }
+  cout << nclients <<" clients OK"<<endl;
+
+  return 0;
+
+}